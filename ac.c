@@ -0,0 +1,167 @@
+/**
+ * @file   ac.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Aho-Corasick multi-pattern automaton implementation
+ *
+ * The trie of the patterns is completed into a deterministic automaton:
+ * failure links are followed once, at construction, so scanning takes a
+ * single table lookup per byte.  Bytes are first mapped to classes, all
+ * bytes occurring in no pattern sharing class 0, which keeps the rows of
+ * the dense transition table short enough to stay in cache.
+ *
+ * Rather than walking the output links at every byte, a scan counts the
+ * visits to each state, and the counts are then passed down the failure
+ * links in reverse breadth-first order: the states whose failure chains
+ * pass through the state of a pattern are exactly those ending with it.
+ */
+
+/* Implements */
+#include "ac.h"
+
+/* Uses */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+struct Automaton {
+  int states;
+  int classes;               // Columns of delta
+  uint16_t cls[256];         // Class of each byte
+  int32_t * delta;           // Next state, by state and class
+  int32_t * fail;            // Longest proper suffix that is a state
+  int32_t * depth;           // Length of the string of a state
+  int32_t * order;           // States in breadth-first order
+  int32_t * match;           // State of each pattern
+  int patterns;
+};
+
+Automaton * ac_create(char * const * patterns, int n) {
+  Automaton * a = calloc(1, sizeof(Automaton));
+  long total = 1;
+  int i, c, k, used[256] = { 0 };
+
+  if (a == NULL) return NULL;
+  for (i = 0; i < n; i++) {
+    const unsigned char * p = (const unsigned char *) patterns[i];
+    for (; *p != '\0'; p++, total++) used[*p] = 1;
+  }
+  for (c = 0, k = 1; c < 256; c++) {
+    a->cls[c] = used[c] ? k++ : 0;
+  }
+  a->classes = k;
+  a->patterns = n;
+
+  a->delta = malloc(sizeof(int32_t) * total * k);
+  a->fail = malloc(sizeof(int32_t) * total);
+  a->depth = malloc(sizeof(int32_t) * total);
+  a->order = malloc(sizeof(int32_t) * total);
+  a->match = malloc(sizeof(int32_t) * (n > 0 ? n : 1));
+  if (a->delta == NULL || a->fail == NULL || a->depth == NULL ||
+      a->order == NULL || a->match == NULL) {
+    ac_destroy(a);
+    return NULL;
+  }
+
+  /* Trie, -1 for missing edges */
+  memset(a->delta, 0xff, sizeof(int32_t) * k);
+  a->depth[0] = 0;
+  a->states = 1;
+  for (i = 0; i < n; i++) {
+    const unsigned char * p = (const unsigned char *) patterns[i];
+    int32_t s = 0;
+    for (; *p != '\0'; p++) {
+      int32_t * edge = &a->delta[s * k + a->cls[*p]];
+      if (*edge < 0) {
+        *edge = a->states;
+        memset(&a->delta[a->states * k], 0xff, sizeof(int32_t) * k);
+        a->depth[a->states] = a->depth[s] + 1;
+        a->states++;
+      }
+      s = *edge;
+    }
+    a->match[i] = s;
+  }
+
+  /*
+   * Breadth first, so the row of a state's failure is complete when the
+   * state is reached: trie edges get their failure, missing edges are
+   * taken from the failure's row.
+   */
+  int head = 0, tail = 0;
+  a->fail[0] = 0;
+  a->order[tail++] = 0;
+  while (head < tail) {
+    int32_t s = a->order[head++];
+    int32_t * row = &a->delta[s * k];
+    const int32_t * fail_row = &a->delta[a->fail[s] * k];
+    for (c = 0; c < k; c++) {
+      if (row[c] > 0) {
+        a->fail[row[c]] = s == 0 ? 0 : fail_row[c];
+        a->order[tail++] = row[c];
+      } else {
+        row[c] = s == 0 ? 0 : fail_row[c];
+      }
+    }
+  }
+
+  int32_t * delta = realloc(a->delta, sizeof(int32_t) * a->states * k);
+  if (delta != NULL) a->delta = delta;
+  return a;
+}
+
+long ac_count(const Automaton * a, const char * text, long length, long starts,
+              long * counts, long * work) {
+  const int32_t * delta = a->delta;
+  const uint16_t * cls = a->cls;
+  const int k = a->classes;
+  long * visits = work, * tail = work + a->states;
+  long i, end = starts < length ? starts : length;
+  long total = 0;
+  int32_t s = 0, t;
+
+  memset(work, 0, sizeof(long) * ac_work(a));
+
+  /* Every occurrence ending before starts also starts before it */
+  for (i = 0; i < end; i++) {
+    s = delta[s * k + cls[(unsigned char) text[i]]];
+    visits[s]++;
+  }
+
+  /* Past it, only those longer than the distance to starts */
+  for (; i < length; i++) {
+    s = delta[s * k + cls[(unsigned char) text[i]]];
+    for (t = s; a->depth[t] > i - starts + 1; t = a->fail[t]) {
+      tail[t]++;
+    }
+  }
+
+  for (i = a->states - 1; i > 0; i--) {
+    t = a->order[i];
+    visits[a->fail[t]] += visits[t];
+  }
+  for (i = 0; i < a->patterns; i++) {
+    long times = visits[a->match[i]] + tail[a->match[i]];
+    counts[i] += times;
+    total += times;
+  }
+  return total;
+}
+
+long ac_work(const Automaton * a) {
+  return 2 * (long) a->states;
+}
+
+int ac_states(const Automaton * a) {
+  return a->states;
+}
+
+void ac_destroy(Automaton * a) {
+  if (a == NULL) return;
+  free(a->delta);
+  free(a->fail);
+  free(a->depth);
+  free(a->order);
+  free(a->match);
+  free(a);
+}
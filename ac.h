@@ -0,0 +1,54 @@
+/**
+ * @file   ac.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Aho-Corasick multi-pattern automaton interface
+ *
+ * An automaton finds the occurrences of many patterns in a single pass
+ * over a text.  Once created it is only read, so any number of threads
+ * may count with the same automaton at once.
+ */
+
+#ifndef AC_H_INCLUDED
+#define AC_H_INCLUDED
+
+typedef struct Automaton Automaton;
+
+/**
+ * @name    ac_create
+ * @brief   Builds the automaton of the non-empty, NUL terminated patterns
+ *          patterns[0..n-1].  Patterns may repeat and overlap.
+ * @retval  The automaton, NULL if it could not be allocated
+ */
+Automaton * ac_create(char * const * patterns, int n);
+
+/**
+ * @name    ac_count
+ * @brief   Counts the occurrences of the patterns lying within
+ *          text[0..length-1] and starting before position starts, adding
+ *          the count of pattern i to counts[i].  work is working space of
+ *          ac_work(a) longs, which a thread may reuse from count to count.
+ * @retval  Total of the occurrences counted
+ */
+long ac_count(const Automaton * a, const char * text, long length, long starts,
+              long * counts, long * work);
+
+/**
+ * @name    ac_work
+ * @brief   Gives the number of longs of working space ac_count needs
+ */
+long ac_work(const Automaton * a);
+
+/**
+ * @name    ac_states
+ * @brief   Gives the number of states of automaton a
+ */
+int ac_states(const Automaton * a);
+
+/**
+ * @name    ac_destroy
+ * @brief   Frees automaton a
+ */
+void ac_destroy(Automaton * a);
+
+#endif /* AC_H_INCLUDED */
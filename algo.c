@@ -0,0 +1,280 @@
+/**
+ * @file   algo.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Parallel algorithms implementation
+ */
+
+/* Implements */
+#include "algo.h"
+
+/* Uses */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCKS_PER_WORKER 4   // Blocks per worker, to even out their loads
+
+/* Start of block i of b blocks over n elements */
+static long bound(long n, long b, long i) {
+  return i * n / b;
+}
+
+static long * alloc_longs(long n) {
+  long * a = malloc(sizeof(long) * (n > 0 ? n : 1));
+  if (a == NULL) {
+    printf("ERROR: Parallel algorithm could not allocate buffer\n");
+    exit(1);
+  }
+  return a;
+}
+
+/* Number of blocks to cut n elements into */
+static long blocks(Pool * p, long n, long per_worker) {
+  long b = per_worker * pool_threads(p);
+
+  if (b > n) b = n;
+  return b > 0 ? b : 1;
+}
+
+
+/***************** Sorting ******************/
+
+typedef struct {
+  long * src, * dst;
+  long n;
+  long blocks;               // A power of two
+  long width;                // Blocks per run merged this round
+  long segments;             // Segments per merge
+} Sort;
+
+static int compare(const void * x, const void * y) {
+  long a = *(const long *) x;
+  long b = *(const long *) y;
+  return (a > b) - (a < b);
+}
+
+static void sort_blocks(long from, long to, void * ctx) {
+  Sort * s = ctx;
+  long i;
+
+  for (i = from; i < to; i++) {
+    long lo = bound(s->n, s->blocks, i);
+    qsort(s->src + lo, bound(s->n, s->blocks, i + 1) - lo, sizeof(long), compare);
+  }
+}
+
+/*
+ * Merge path: the number of elements of a among the first k of the merge
+ * of a[0..m-1] and b[0..n-1], ties taken from a first.
+ */
+static long corank(long k, const long * a, long m, const long * b, long n) {
+  long lo = k > n ? k - n : 0;
+  long hi = k < m ? k : m;
+
+  while (lo < hi) {
+    long i = lo + (hi - lo) / 2;
+    if (a[i] <= b[k - i - 1]) {
+      lo = i + 1;            // a[i] comes before b[k-i-1], take more of a
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+/* Merges the segments from..to-1, each a part of the output of one merge */
+static void merge_segments(long from, long to, void * ctx) {
+  Sort * s = ctx;
+  long k;
+
+  for (k = from; k < to; k++) {
+    long pair = k / s->segments, seg = k % s->segments;
+    long lo = bound(s->n, s->blocks, 2 * pair * s->width);
+    long mid = bound(s->n, s->blocks, (2 * pair + 1) * s->width);
+    long hi = bound(s->n, s->blocks, (2 * pair + 2) * s->width);
+    const long * a = s->src + lo, * b = s->src + mid;
+    long m = mid - lo, n = hi - mid;
+
+    long k0 = (hi - lo) * seg / s->segments;
+    long k1 = (hi - lo) * (seg + 1) / s->segments;
+    long i = corank(k0, a, m, b, n), j = k0 - i;
+    long i1 = corank(k1, a, m, b, n), j1 = k1 - i1;
+    long * out = s->dst + lo + k0;
+
+    while (i < i1 && j < j1) {
+      *out++ = a[i] <= b[j] ? a[i++] : b[j++];
+    }
+    while (i < i1) *out++ = a[i++];
+    while (j < j1) *out++ = b[j++];
+  }
+}
+
+static void copy_blocks(long from, long to, void * ctx) {
+  Sort * s = ctx;
+  long lo = bound(s->n, s->blocks, from);
+
+  memcpy(s->dst + lo, s->src + lo, sizeof(long) * (bound(s->n, s->blocks, to) - lo));
+}
+
+void algo_sort(Pool * p, long * a, long n) {
+  Sort s;
+  long b = 1, max = blocks(p, n, BLOCKS_PER_WORKER);
+
+  if (n < 2) return;
+  while (2 * b <= max) b *= 2;
+
+  s.src = a;
+  s.dst = alloc_longs(n);
+  s.n = n;
+  s.blocks = b;
+  pool_parallel_for_to(p, 0, b, 1, 0, sort_blocks, &s);
+
+  /* Each round halves the runs, and cuts every merge into as many
+     segments as there are pairs fewer, to keep b segments in all */
+  for (s.width = 1; s.width < b; s.width *= 2) {
+    s.segments = s.width * 2;
+    pool_parallel_for_to(p, 0, b, 1, 0, merge_segments, &s);
+    long * t = s.src;
+    s.src = s.dst;
+    s.dst = t;
+  }
+
+  if (s.src != a) {
+    s.dst = a;
+    pool_parallel_for_to(p, 0, b, 1, 0, copy_blocks, &s);
+    free(s.src);
+  } else {
+    free(s.dst);
+  }
+}
+
+
+/***************** Prefix sums ******************/
+
+typedef struct {
+  const long * in;
+  long * out;
+  long n;
+  long blocks;
+  long * sums;               // Block sums, then block offsets
+} Scan;
+
+static void sum_blocks(long from, long to, void * ctx) {
+  Scan * s = ctx;
+  long i, x;
+
+  for (i = from; i < to; i++) {
+    long sum = 0, hi = bound(s->n, s->blocks, i + 1);
+    for (x = bound(s->n, s->blocks, i); x < hi; x++) {
+      sum += s->in[x];
+    }
+    s->sums[i] = sum;
+  }
+}
+
+static void scan_blocks(long from, long to, void * ctx) {
+  Scan * s = ctx;
+  long i, x;
+
+  for (i = from; i < to; i++) {
+    long acc = s->sums[i], hi = bound(s->n, s->blocks, i + 1);
+    for (x = bound(s->n, s->blocks, i); x < hi; x++) {
+      long v = s->in[x];     // in may be out
+      s->out[x] = acc;
+      acc += v;
+    }
+  }
+}
+
+long algo_scan(Pool * p, const long * in, long * out, long n) {
+  Scan s;
+  long i, total = 0;
+
+  if (n <= 0) return 0;
+  s.in = in;
+  s.out = out;
+  s.n = n;
+  s.blocks = blocks(p, n, BLOCKS_PER_WORKER);
+  s.sums = alloc_longs(s.blocks);
+
+  pool_parallel_for_to(p, 0, s.blocks, 1, 0, sum_blocks, &s);
+  for (i = 0; i < s.blocks; i++) {
+    long sum = s.sums[i];
+    s.sums[i] = total;
+    total += sum;
+  }
+  pool_parallel_for_to(p, 0, s.blocks, 1, 0, scan_blocks, &s);
+
+  free(s.sums);
+  return total;
+}
+
+
+/***************** Histograms ******************/
+
+typedef struct {
+  const long * a;
+  long n;
+  long blocks;
+  long min, max, width;
+  int nbins;
+  long * private;            // nbins counts per block
+  long * bins;
+} Histogram;
+
+static void count_blocks(long from, long to, void * ctx) {
+  Histogram * h = ctx;
+  long i, x;
+
+  for (i = from; i < to; i++) {
+    long * bins = h->private + i * h->nbins;
+    long hi = bound(h->n, h->blocks, i + 1);
+    for (x = bound(h->n, h->blocks, i); x < hi; x++) {
+      long v = h->a[x];
+      if (v >= h->min && v < h->max) bins[(v - h->min) / h->width]++;
+    }
+  }
+}
+
+static void add_bins(long from, long to, void * ctx) {
+  Histogram * h = ctx;
+  long b, i;
+
+  for (b = from; b < to; b++) {
+    long sum = 0;
+    for (i = 0; i < h->blocks; i++) {
+      sum += h->private[i * h->nbins + b];
+    }
+    h->bins[b] = sum;
+  }
+}
+
+void algo_histogram(Pool * p, const long * a, long n, long min, long max,
+                    long * bins, int nbins) {
+  Histogram h;
+
+  if (nbins <= 0 || max <= min) {
+    printf("ERROR: Histogram with no bins or empty range\n");
+    exit(1);
+  }
+
+  /* One block per worker, each with its own bins */
+  h.a = a;
+  h.n = n;
+  h.blocks = blocks(p, n, 1);
+  h.min = min;
+  h.max = max;
+  h.width = (max - min + nbins - 1) / nbins;
+  h.nbins = nbins;
+  h.bins = bins;
+  h.private = calloc(h.blocks * nbins, sizeof(long));
+  if (h.private == NULL) {
+    printf("ERROR: Parallel algorithm could not allocate buffer\n");
+    exit(1);
+  }
+
+  pool_parallel_for_to(p, 0, h.blocks, 1, 0, count_blocks, &h);
+  pool_parallel_for_to(p, 0, nbins, 0, 0, add_bins, &h);
+  free(h.private);
+}
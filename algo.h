@@ -0,0 +1,44 @@
+/**
+ * @file   algo.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Parallel algorithms interface
+ *
+ * Sorting, prefix sums and histograms of long arrays, run on a thread pool
+ * with pool_parallel_for.  The arrays are cut into a few blocks per worker.
+ */
+
+#ifndef ALGO_H_INCLUDED
+#define ALGO_H_INCLUDED
+
+#include "pool.h"
+
+/**
+ * @name    algo_sort
+ * @brief   Sorts a[0..n-1] in ascending order on pool p: blocks are sorted
+ *          in parallel, then merged pairwise, each merge cut into segments
+ *          at merge path split points so all workers take part in every
+ *          round.  Uses a buffer of n elements.
+ */
+void algo_sort(Pool * p, long * a, long n);
+
+/**
+ * @name    algo_scan
+ * @brief   Computes the exclusive prefix sums of in[0..n-1] into out on pool
+ *          p, in two passes: block sums, then the blocks from their offsets.
+ *          in and out may be the same array.
+ * @retval  Sum of all elements
+ */
+long algo_scan(Pool * p, const long * in, long * out, long n);
+
+/**
+ * @name    algo_histogram
+ * @brief   Counts the elements of a[0..n-1] into nbins bins of equal width
+ *          covering [min, max), on pool p.  Elements outside are not
+ *          counted.  Each block counts into private bins, which are then
+ *          added up bin by bin.
+ */
+void algo_histogram(Pool * p, const long * a, long n, long min, long max,
+                    long * bins, int nbins);
+
+#endif /* ALGO_H_INCLUDED */
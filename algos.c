@@ -0,0 +1,245 @@
+/** 
+ * Program benchmarking the parallel algorithms against serial baselines
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "pool.h"
+#include "algo.h"
+
+#define WARMUPS 2                    // Warmup runs to fill cache etc.
+#define RUNS    5                    // Number of regular runs to get stable average
+
+#define VALUE_RANGE (1L << 20)       // Elements are drawn from [0, VALUE_RANGE)
+#define BINS        256              // Histogram bins
+
+
+/* Program parameters */
+static long elements = 1000000;
+static int threads = 1;
+static char * data_file_name = NULL;
+static int stealing = 0;
+
+/* Input, and outputs of the serial and the parallel runs */
+static long * input;
+static long * serial_out;
+static long * parallel_out;
+
+/* Data file */
+static FILE * data_file = NULL;
+
+uint64_t micros(void) {
+  struct timeval now;
+  gettimeofday(&now,NULL);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}  
+
+/*
+ * Read options, then positional args: elements [threads [data_file]]
+ */
+void read_args(int argc, char ** argv) {
+  long n; 
+
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--steal") == 0) {
+      stealing = 1;
+    } else {
+      printf("ERROR: Unknown option %s\n", argv[1]);
+      exit(1);
+    }
+    argc--;
+    argv++;
+  }
+
+  if (argc < 2) {
+    printf("Usage: algos [--steal] <elements> [<threads> [<data file>] ]\n");
+    exit(1);
+  }
+
+  n = atol(argv[1]);
+  if (n > 0) elements = n;
+
+  if (argc <= 2) return;
+  n = atoi(argv[2]);
+  if (n > 1) threads = n;
+
+  if (argc <= 3) return;
+  data_file_name = argv[3];
+  data_file = fopen(data_file_name, "a");
+  if (data_file == NULL) {
+    printf("ERROR: Data file %s could not be opened\n", data_file_name);
+    exit(1);
+  }
+}
+
+/* Fills the input with pseudo-random values (xorshift) */
+void generate(void) {
+  uint64_t x = 88172645463325252ULL;
+  long i;
+
+  for (i = 0; i < elements; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    input[i] = x % VALUE_RANGE;
+  }
+}
+
+
+/* Serial baselines */
+
+int compare(const void * x, const void * y) {
+  long a = *(const long *) x;
+  long b = *(const long *) y;
+  return (a > b) - (a < b);
+}
+
+void serial_scan(const long * in, long * out, long n) {
+  long i, acc = 0;
+
+  for (i = 0; i < n; i++) {
+    out[i] = acc;
+    acc += in[i];
+  }
+}
+
+void serial_histogram(const long * a, long n, long * bins) {
+  long i, width = (VALUE_RANGE + BINS - 1) / BINS;
+
+  memset(bins, 0, sizeof(long) * BINS);
+  for (i = 0; i < n; i++) {
+    bins[a[i] / width]++;
+  }
+}
+
+
+/*
+ * Runs of the algorithms, serially or on the pool, into out.
+ * Return the time taken in us, preparing out not included.
+ */
+
+uint64_t run_sort(int parallel, long * out) {
+  uint64_t start;
+
+  memcpy(out, input, sizeof(long) * elements);
+  start = micros();
+  if (parallel) {
+    algo_sort(pool_default(), out, elements);
+  } else {
+    qsort(out, elements, sizeof(long), compare);
+  }
+  return micros() - start;
+}
+
+uint64_t run_scan(int parallel, long * out) {
+  uint64_t start = micros();
+
+  if (parallel) {
+    algo_scan(pool_default(), input, out, elements);
+  } else {
+    serial_scan(input, out, elements);
+  }
+  return micros() - start;
+}
+
+uint64_t run_histogram(int parallel, long * out) {
+  uint64_t start = micros();
+
+  if (parallel) {
+    algo_histogram(pool_default(), input, elements, 0, VALUE_RANGE, out, BINS);
+  } else {
+    serial_histogram(input, elements, out);
+  }
+  return micros() - start;
+}
+
+
+/*
+ * Benchmarks one algorithm: warmups, then regular serial and parallel runs.
+ * Results are compared, the first out_length elements of the outputs.
+ */
+void benchmark(const char * name, uint64_t (*run)(int, long *), long out_length) {
+  int k;
+  uint64_t time;
+  unsigned long total_time_serial = 0, total_time_parallel = 0;
+
+  printf("***** %s *****\n\n", name);
+
+  for (k = 0; k < WARMUPS; k++) {
+    time = run(0, serial_out);
+    printf("Warmup run no. %d, serial. time = %lu [us]\n", k, time);
+    time = run(1, parallel_out);
+    printf("Warmup run no. %d, parallel. time = %lu [us]\n", k, time);
+  }
+  printf("\n");
+
+  for (k = 0; k < RUNS; k++) {
+    time = run(0, serial_out);
+    printf("Proper run no. %d, serial. time = %lu [us]\n", k, time);
+    total_time_serial += time;
+  }
+  printf("Average of serial runs: %.1f [us]\n\n", (float) total_time_serial/RUNS);
+
+  for (k = 0; k < RUNS; k++) {
+    time = run(1, parallel_out);
+    printf("Proper run no. %d, parallel. time = %lu [us]\n", k, time);
+    total_time_parallel += time;
+  }
+  printf("Average of parallel runs: %.1f [us]\n\n", (float) total_time_parallel/RUNS);
+
+  float speedup = (float) total_time_serial / (float) total_time_parallel;
+  printf("  Speedup = %f\n\n", speedup);
+
+  int same = memcmp(serial_out, parallel_out, sizeof(long) * out_length) == 0;
+  if (!same) {
+    printf("  WARNING: RESULTS DIFFER\n\n");
+  }
+
+  if (same && data_file != NULL) {
+    fprintf(data_file, "%s, %ld, %d, %.1f, %.1f, %f\n", name, elements, threads,
+            (float) total_time_serial/RUNS, (float) total_time_parallel/RUNS, speedup);
+  }
+}
+
+
+int main(int argc, char ** argv) {
+  read_args(argc, argv);
+
+  printf("Running algorithms with: \n"
+	 "  elements = %ld, threads = %d%s\n", elements, threads,
+	 stealing ? " (work stealing)" : "");
+  if (data_file != NULL) {
+    printf("  Data file = %s\n", data_file_name);
+  }
+  printf("\n");
+
+  input = malloc(sizeof(long) * elements);
+  serial_out = malloc(sizeof(long) * (elements > BINS ? elements : BINS));
+  parallel_out = malloc(sizeof(long) * (elements > BINS ? elements : BINS));
+  if (input == NULL || serial_out == NULL || parallel_out == NULL) {
+    printf("ERROR: Arrays could not be allocated\n");
+    exit(1);
+  }
+  generate();
+
+  if (stealing) {
+    pool_init_stealing(threads);
+  } else {
+    pool_init(threads);
+  }
+
+  benchmark("sort", run_sort, elements);
+  benchmark("scan", run_scan, elements);
+  benchmark("histogram", run_histogram, BINS);
+
+  if (data_file != NULL) {
+    printf("Algorithm data written to %s\n", data_file_name);
+  }
+
+  return 0;
+}
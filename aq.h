@@ -19,11 +19,14 @@ typedef char MsgKind;
 #define AQ_ALARM        1   // Message is of kind alarm
 #define AQ_NORMAL       0   // Message if of kind normal
 
+#define AQ_MAX_LEVELS  32   // Max priority levels of normal messages
+
 /* Error codes */
 #define AQ_UNINIT      -1   // Queue has not been initialized
 #define AQ_NULL_MSG    -2   // Sent message is NULL
 #define AQ_NO_MSG      -3   // No messages
 #define AQ_NO_ROOM     -4   // No room for message
+#define AQ_BAD_PRIO    -5   // Priority level out of range
 #define AQ_NOT_IMPL  -100   // Operation is not implemented
 
 typedef void * AlarmQueue;  // Opaque type 
@@ -35,6 +38,34 @@ typedef void * AlarmQueue;  // Opaque type
  */
 AlarmQueue aq_create( );
 
+/**
+ * @name    aq_create_bounded
+ * @brief   Creates and initializes an alarm queue holding at most capacity
+ *          normal messages (plus the alarm slot).  Senders block, or fail
+ *          with AQ_NO_ROOM for non-blocking sends, while the queue is full.
+ * @retval  Handle to alarm queue if created, otherwise NULL
+ */
+AlarmQueue aq_create_bounded( int capacity);
+
+/**
+ * @name    aq_create_prio
+ * @brief   Creates and initializes an alarm queue whose normal messages are
+ *          kept in levels priority levels (1..AQ_MAX_LEVELS), 0 being the
+ *          highest.  Messages are received from the highest non-empty level,
+ *          FIFO within a level.  Normal messages sent with aq_send (or in a
+ *          batch) are given level levels/2.  Alarms still come first.
+ * @retval  Handle to alarm queue if created, otherwise NULL
+ */
+AlarmQueue aq_create_prio( int levels);
+
+/**
+ * @name    aq_destroy
+ * @brief   Frees an alarm queue.  No thread may use it afterwards; messages
+ *          still held by it are dropped (not freed).
+ * @retval  0 if the queue was destroyed, otherwise an error code.
+ */
+int aq_destroy( AlarmQueue aq);
+
 /**
  * @name    aq_send
  * @brief   Sends message pointed to by msg with kind indicated.
@@ -49,6 +80,93 @@ int aq_send( AlarmQueue aq, void * msg, MsgKind k);
  */
 int aq_recv( AlarmQueue aq, void * * msg);
 
+/**
+ * @name    aq_send_prio
+ * @brief   Sends normal message pointed to by msg with priority level prio.
+ * @retval  0 if message was successfully sent, otherwise an error code.
+ */
+int aq_send_prio( AlarmQueue aq, void * msg, int prio);
+
+/**
+ * @name    aq_set_aging
+ * @brief   Enables aging: after limit consecutive receives that passed over
+ *          messages of a lower priority, a lower non-empty level is served
+ *          once.  The lower levels take these turns in order, so none of
+ *          them is starved.  0 disables aging (the default).
+ */
+void aq_set_aging( AlarmQueue aq, int limit);
+
+/**
+ * @name    aq_try_send
+ * @brief   Sends message pointed to by msg with kind indicated if there is
+ *          room for it right away.  Never blocks.
+ * @retval  0 if message was successfully sent, AQ_NO_ROOM if there was no
+ *          room for it, otherwise an error code.
+ */
+int aq_try_send( AlarmQueue aq, void * msg, MsgKind k);
+
+/**
+ * @name    aq_try_recv
+ * @brief   Receives a message setting the supplied msg pointer if one is
+ *          ready right away.  Never blocks.
+ * @retval  Kind of message if message was received successfully, AQ_NO_MSG
+ *          if the queue was empty, otherwise an error code.
+ */
+int aq_try_recv( AlarmQueue aq, void * * msg);
+
+/**
+ * @name    aq_send_timeout
+ * @brief   As aq_send, but gives up if there is still no room for the
+ *          message after timeout_us microseconds.
+ * @retval  0 if message was successfully sent, AQ_NO_ROOM on timeout,
+ *          otherwise an error code.
+ */
+int aq_send_timeout( AlarmQueue aq, void * msg, MsgKind k, long timeout_us);
+
+/**
+ * @name    aq_recv_timeout
+ * @brief   As aq_recv, but gives up if no message is ready after
+ *          timeout_us microseconds.
+ * @retval  Kind of message if message was received successfully, AQ_NO_MSG
+ *          on timeout, otherwise an error code.
+ */
+int aq_recv_timeout( AlarmQueue aq, void * * msg, long timeout_us);
+
+/**
+ * @name    aq_send_batch
+ * @brief   Sends the n messages msgs[0..n-1] with kinds kinds[0..n-1] as one
+ *          operation.  If kinds is NULL, all messages are normal.  Alarms of
+ *          the batch are still received before its normal messages.
+ * @retval  Number of messages sent, otherwise an error code.  Fewer than n
+ *          are sent only if the queue runs out of memory: then all alarms
+ *          and the normal messages before the first one not sent.
+ */
+int aq_send_batch( AlarmQueue aq, void * * msgs, MsgKind * kinds, int n);
+
+/**
+ * @name    aq_recv_batch
+ * @brief   Receives up to max messages into out[], alarms first.  Kinds are
+ *          stored in kinds_out[] unless it is NULL.  Blocks until at least one
+ *          message is ready.
+ * @retval  Number of messages received if successful, otherwise an error code.
+ */
+int aq_recv_batch( AlarmQueue aq, void * * out, int max, MsgKind * kinds_out);
+
+/**
+ * @name    aq_set_spin
+ * @brief   Sets the upper bound on the number of iterations a receiver spins
+ *          before it parks.  The actual budget adapts to recent wait times
+ *          below this bound.  0 disables spinning, negative selects the default.
+ */
+void aq_set_spin( AlarmQueue aq, int max_spin);
+
+/**
+ * @name    aq_wait_stats
+ * @brief   Gives the number of receives that had to wait for a message and
+ *          were satisfied while spinning, and the number that had to park.
+ */
+void aq_wait_stats( AlarmQueue aq, long * spun, long * parked);
+
 /**
  * @name    aq_size
  * @brief   Give size of alarm queue in terms of messages
@@ -0,0 +1,598 @@
+/**
+ * @file   aq_lockfree.c
+ * @Author 02335 team
+ * @date   October, 2024
+ * @brief  Lock-free alarm queue implementation
+ *
+ * Normal messages travel through bounded multi-producer/multi-consumer
+ * rings (D. Vyukov's sequence-numbered cells), one per priority level,
+ * alarms through a single slot claimed with compare-and-swap.  A bitmap
+ * of possibly non-empty levels is kept as a hint for receivers.  Threads
+ * only park on a futex when there is no message to take, or when there is
+ * no room for the message they want to send (alarm slot occupied or
+ * bounded ring full), and receivers spin adaptively before parking.
+ *
+ * The rings of an unbounded queue overflow into a list under a mutex, so
+ * sends never block; receivers move the list back into the ring as it
+ * empties.
+ */
+
+#include "aq.h"
+#include "park.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define AQ_LF_CAPACITY  (1 << 14)   // Ring slots for normal messages (power of two)
+#define CACHE_LINE      64
+
+typedef struct Cell {
+    unsigned long seq;
+    void *msg;
+} Cell;
+
+/*
+ * A futex based event count.  Waiters announce themselves before their
+ * final check, so notifiers only pay for a syscall if somebody is parked.
+ */
+typedef struct Event {
+    int epoch;
+    int waiters;
+} Event;
+
+#define ALARM_LEVEL     -1          // Level used internally for the alarm slot
+
+typedef struct Spill {
+    void *msg;
+    struct Spill *next;
+} Spill;
+
+typedef struct Ring {
+    unsigned long enqPos __attribute__((aligned(CACHE_LINE)));
+    unsigned long deqPos __attribute__((aligned(CACHE_LINE)));
+    int count;                 // Messages counted into the ring, overflow included
+    int spilled;               // Messages in the overflow list
+    unsigned long mask;
+    Cell *cells;
+    pthread_mutex_t lock;      // Guards the overflow list
+    Spill *head, *tail;        // Overflow list of an unbounded queue, oldest first
+} Ring;
+
+typedef struct Queue {
+    void *alarmMsg __attribute__((aligned(CACHE_LINE)));   // NULL if slot is free
+    int size;
+    unsigned int nonEmpty;     // Bit per level that may hold messages
+    int bypassed;              // Receives that passed over lower non-empty levels
+    Event message_sent;        // Receivers wait here
+    Event room_made;           // Senders wait here
+    ParkPolicy waitPolicy;     // Spinning of receivers before parking
+    int levels;
+    int defaultLevel;          // Level of messages sent as AQ_NORMAL
+    int aging;                 // Bypass limit before serving a lower level, 0 if off
+    int aged;                  // Level last served by aging, -1 if none
+    int capacity;              // Max normal messages per ring, 0 if unbounded
+    Ring *rings;
+} Queue;
+
+static void event_notify(Event *ev, int n) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ev->waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(&ev->epoch, 1, __ATOMIC_SEQ_CST);
+        park_wake(&ev->epoch, n);
+    }
+}
+
+/* Ring operations, return 0 on success */
+
+static int ring_push(Ring *queue, void *msg) {
+    Cell *cell;
+    unsigned long pos = __atomic_load_n(&queue->enqPos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) seq - (long) pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqPos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return AQ_NO_ROOM;
+        } else {
+            pos = __atomic_load_n(&queue->enqPos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->msg = msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ring_pop(Ring *queue, void **msg) {
+    Cell *cell;
+    unsigned long pos = __atomic_load_n(&queue->deqPos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) seq - (long) (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&queue->deqPos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return AQ_NO_MSG;
+        } else {
+            pos = __atomic_load_n(&queue->deqPos, __ATOMIC_RELAXED);
+        }
+    }
+    *msg = cell->msg;
+    __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Overflow of an unbounded queue whose ring is full.  Once a message has
+ * spilled, later ones follow it into the list until receivers have moved
+ * it back into the ring, so each sender's messages keep their order.
+ */
+static int spill(Ring *ring, void *msg) {
+    Spill *node = malloc(sizeof(Spill));
+
+    if (node == NULL) return AQ_NO_ROOM;
+    node->msg = msg;
+    node->next = NULL;
+    pthread_mutex_lock(&ring->lock);
+    if (ring->tail == NULL) {
+        ring->head = node;
+    } else {
+        ring->tail->next = node;
+    }
+    ring->tail = node;
+    __atomic_fetch_add(&ring->spilled, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+/* Takes the oldest spilled message, moving the rest into the ring as they fit */
+static int unspill(Ring *ring, void **msg) {
+    Spill *node;
+
+    pthread_mutex_lock(&ring->lock);
+    if ((node = ring->head) == NULL) {
+        pthread_mutex_unlock(&ring->lock);
+        return AQ_NO_MSG;
+    }
+    *msg = node->msg;
+    do {
+        ring->head = node->next;
+        free(node);
+        __atomic_fetch_sub(&ring->spilled, 1, __ATOMIC_SEQ_CST);
+    } while ((node = ring->head) != NULL && ring_push(ring, node->msg) == 0);
+    if (ring->head == NULL) ring->tail = NULL;
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+/*
+ * Counts a message into a bounded ring if it is below capacity.  Only
+ * successful senders move the count up, so a sender never sees the ring
+ * full while there is room.
+ */
+static int reserve(Ring *ring, int capacity) {
+    int count = __atomic_load_n(&ring->count, __ATOMIC_SEQ_CST);
+
+    do {
+        if (count >= capacity) return AQ_NO_ROOM;
+    } while (!__atomic_compare_exchange_n(&ring->count, &count, count + 1, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return 0;
+}
+
+/* Single attempts, without parking or notifying */
+
+static int push_msg(Queue *queue, void *msg, int level) {
+    int res = 0;
+
+    // Count the message before publishing it, so size never goes negative
+    __atomic_fetch_add(&queue->size, 1, __ATOMIC_RELAXED);
+    if (level == ALARM_LEVEL) {
+        void *expected = NULL;
+        if (!__atomic_compare_exchange_n(&queue->alarmMsg, &expected, msg, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            res = AQ_NO_ROOM;
+        }
+    } else {
+        Ring *ring = &queue->rings[level];
+        if (queue->capacity > 0) {
+            if ((res = reserve(ring, queue->capacity)) == 0) {
+                // A receiver still taking an older message may hold the next cell
+                while (ring_push(ring, msg) != 0) sched_yield();
+            }
+        } else {
+            __atomic_fetch_add(&ring->count, 1, __ATOMIC_SEQ_CST);
+            if ((__atomic_load_n(&ring->spilled, __ATOMIC_SEQ_CST) > 0 || ring_push(ring, msg) != 0) &&
+                (res = spill(ring, msg)) != 0) {
+                __atomic_fetch_sub(&ring->count, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (res == 0) __atomic_fetch_or(&queue->nonEmpty, 1u << level, __ATOMIC_SEQ_CST);
+    }
+    if (res != 0) {
+        __atomic_fetch_sub(&queue->size, 1, __ATOMIC_RELAXED);
+    }
+    return res;
+}
+
+/*
+ * The overflow list is only taken from once the ring is empty.  A level
+ * found empty has its bit cleared, and set again if a sender counted a
+ * message into it meanwhile, so a bit is never lost.
+ */
+static int pop_level(Queue *queue, int level, void **msg) {
+    Ring *ring = &queue->rings[level];
+
+    if (ring_pop(ring, msg) == 0 ||
+        (__atomic_load_n(&ring->spilled, __ATOMIC_SEQ_CST) > 0 && unspill(ring, msg) == 0)) {
+        __atomic_fetch_sub(&ring->count, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_fetch_and(&queue->nonEmpty, ~(1u << level), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->count, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_fetch_or(&queue->nonEmpty, 1u << level, __ATOMIC_SEQ_CST);
+    }
+    return AQ_NO_MSG;
+}
+
+/*
+ * Level served by aging: the first non-empty level below the one aging
+ * served last, wrapping around to the first below the highest, top.  The
+ * lower levels thus take turns, and none of them is starved.
+ */
+static int aged_level(unsigned int bits, int top, int aged) {
+    unsigned int lower = bits & ~((2u << top) - 1);
+    unsigned int after = aged < 0 ? lower : lower & ~((2u << aged) - 1);
+    return __builtin_ctz(after != 0 ? after : lower);
+}
+
+static int pop_normal(Queue *queue, void **msg) {
+    unsigned int bits;
+
+    while ((bits = __atomic_load_n(&queue->nonEmpty, __ATOMIC_SEQ_CST)) != 0) {
+        int level = __builtin_ctz(bits);
+
+        // Aging: now and then serve a lower non-empty level first
+        int aging = __atomic_load_n(&queue->aging, __ATOMIC_RELAXED);
+        if (aging > 0 && (bits >> level) > 1) {
+            if (__atomic_add_fetch(&queue->bypassed, 1, __ATOMIC_RELAXED) >= aging) {
+                int aged = aged_level(bits, level, __atomic_load_n(&queue->aged, __ATOMIC_RELAXED));
+                __atomic_store_n(&queue->bypassed, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&queue->aged, aged, __ATOMIC_RELAXED);
+                if (pop_level(queue, aged, msg) == 0) return 0;
+                continue;
+            }
+        }
+        if (pop_level(queue, level, msg) == 0) return 0;
+    }
+    return AQ_NO_MSG;
+}
+
+static int pop_msg(Queue *queue, void **msg) {
+    int kind;
+
+    if (__atomic_load_n(&queue->alarmMsg, __ATOMIC_ACQUIRE) != NULL &&
+        (*msg = __atomic_exchange_n(&queue->alarmMsg, NULL, __ATOMIC_SEQ_CST)) != NULL) {
+        kind = AQ_ALARM;
+    } else if (pop_normal(queue, msg) == 0) {
+        kind = AQ_NORMAL;
+    } else {
+        return AQ_NO_MSG;
+    }
+    __atomic_fetch_sub(&queue->size, 1, __ATOMIC_RELAXED);
+    return kind;
+}
+
+static int has_message(void *arg) {
+    Queue *queue = arg;
+    return __atomic_load_n(&queue->size, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Blocking operations, parking on the relevant event when needed */
+
+static int send_msg(Queue *queue, void *msg, int level, const struct timespec *deadline) {
+    int res = 0;
+
+    if (push_msg(queue, msg, level) == 0) return 0;
+    // Unbounded rings only refuse messages when out of memory
+    if (level != ALARM_LEVEL && queue->capacity == 0) return AQ_NO_ROOM;
+
+    // No room: park until a receiver frees the alarm slot or a ring cell
+    __atomic_fetch_add(&queue->room_made.waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        int epoch = __atomic_load_n(&queue->room_made.epoch, __ATOMIC_SEQ_CST);
+        if (push_msg(queue, msg, level) == 0) break;
+        // Receivers may be parked on messages we have published already
+        event_notify(&queue->message_sent, INT_MAX);
+        if (park_wait(&queue->room_made.epoch, epoch, deadline) == ETIMEDOUT) {
+            res = AQ_NO_ROOM;
+            break;
+        }
+    }
+    __atomic_fetch_sub(&queue->room_made.waiters, 1, __ATOMIC_RELAXED);
+    return res;
+}
+
+static int recv_msg(Queue *queue, void **msg, const struct timespec *deadline) {
+    int kind;
+
+    if ((kind = pop_msg(queue, msg)) >= 0) return kind;
+
+    if (park_spin(&queue->waitPolicy, has_message, queue) &&
+        (kind = pop_msg(queue, msg)) >= 0) {
+        return kind;
+    }
+
+    // Queue is empty: park until a sender publishes a message
+    __atomic_fetch_add(&queue->message_sent.waiters, 1, __ATOMIC_SEQ_CST);
+    for (int slept = 0; ; slept = 1) {
+        int epoch = __atomic_load_n(&queue->message_sent.epoch, __ATOMIC_SEQ_CST);
+        if ((kind = pop_msg(queue, msg)) >= 0) break;
+        if (!slept) park_slept(&queue->waitPolicy);
+        if (park_wait(&queue->message_sent.epoch, epoch, deadline) == ETIMEDOUT) break;
+    }
+    __atomic_fetch_sub(&queue->message_sent.waiters, 1, __ATOMIC_RELAXED);
+    return kind;
+}
+
+static Queue *create_queue(int levels, unsigned long slots, int capacity) {
+    Queue *aq = aligned_alloc(CACHE_LINE, sizeof(Queue));
+    if (aq == NULL) return NULL;
+
+    aq->rings = aligned_alloc(CACHE_LINE, sizeof(Ring) * levels);
+    if (aq->rings == NULL) {
+        free(aq);
+        return NULL;
+    }
+    for (int l = 0; l < levels; l++) {
+        Ring *ring = &aq->rings[l];
+        ring->cells = malloc(sizeof(Cell) * slots);
+        if (ring->cells == NULL) {
+            while (--l >= 0) free(aq->rings[l].cells);
+            free(aq->rings);
+            free(aq);
+            return NULL;
+        }
+        for (unsigned long i = 0; i < slots; i++) {
+            ring->cells[i].seq = i;
+            ring->cells[i].msg = NULL;
+        }
+        ring->mask = slots - 1;
+        ring->enqPos = 0;
+        ring->deqPos = 0;
+        ring->count = 0;
+        ring->spilled = 0;
+        ring->head = ring->tail = NULL;
+        pthread_mutex_init(&ring->lock, NULL);
+    }
+    aq->levels = levels;
+    aq->defaultLevel = levels / 2;
+    aq->aging = 0;
+    aq->capacity = capacity;
+    aq->nonEmpty = 0;
+    aq->bypassed = 0;
+    aq->aged = -1;
+    aq->alarmMsg = NULL;
+    aq->size = 0;
+    aq->message_sent.epoch = aq->message_sent.waiters = 0;
+    aq->room_made.epoch = aq->room_made.waiters = 0;
+    park_init(&aq->waitPolicy, -1);
+    return aq;
+}
+
+/*
+ * An unbounded queue gets rings of the default size, which overflow into
+ * their lists; bounded ones get a ring rounded up to a power of two, and
+ * senders are held to the exact capacity by the ring's count.  Priority
+ * levels each get a ring of their own.
+ */
+AlarmQueue aq_create() {
+    return create_queue(1, AQ_LF_CAPACITY, 0);
+}
+
+AlarmQueue aq_create_bounded(int capacity) {
+    unsigned long slots = 2;
+
+    if (capacity <= 0) return NULL;
+    while (slots < (unsigned long) capacity) slots <<= 1;
+    return create_queue(1, slots, capacity);
+}
+
+AlarmQueue aq_create_prio(int levels) {
+    if (levels <= 0 || levels > AQ_MAX_LEVELS) return NULL;
+    return create_queue(levels, AQ_LF_CAPACITY, 0);
+}
+
+int aq_destroy(AlarmQueue aq) {
+    if (aq == NULL) return AQ_UNINIT;
+    Queue *queue = aq;
+    for (int l = 0; l < queue->levels; l++) {
+        Ring *ring = &queue->rings[l];
+        Spill *node;
+        while ((node = ring->head) != NULL) {
+            ring->head = node->next;
+            free(node);
+        }
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->cells);
+    }
+    free(queue->rings);
+    free(queue);
+    return 0;
+}
+
+static int level_of(Queue *queue, MsgKind k) {
+    return k == AQ_ALARM ? ALARM_LEVEL : queue->defaultLevel;
+}
+
+int aq_send(AlarmQueue aq, void *msg, MsgKind k) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+
+    int res = send_msg(queue, msg, level_of(queue, k), NULL);
+    if (res == 0) event_notify(&queue->message_sent, 1);
+    return res;
+}
+
+int aq_recv(AlarmQueue aq, void **msg) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+
+    int kind = recv_msg(queue, msg, NULL);
+    // Waiting alarm and normal senders share the event, so wake them all
+    event_notify(&queue->room_made, INT_MAX);
+    return kind;
+}
+
+int aq_send_prio(AlarmQueue aq, void *msg, int prio) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+
+    if (prio < 0 || prio >= queue->levels) return AQ_BAD_PRIO;
+    int res = send_msg(queue, msg, prio, NULL);
+    if (res == 0) event_notify(&queue->message_sent, 1);
+    return res;
+}
+
+int aq_try_send(AlarmQueue aq, void *msg, MsgKind k) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+
+    if (push_msg(queue, msg, level_of(queue, k)) != 0) return AQ_NO_ROOM;
+    event_notify(&queue->message_sent, 1);
+    return 0;
+}
+
+int aq_try_recv(AlarmQueue aq, void **msg) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+
+    int kind = pop_msg(queue, msg);
+    if (kind >= 0) event_notify(&queue->room_made, INT_MAX);
+    return kind;
+}
+
+int aq_send_timeout(AlarmQueue aq, void *msg, MsgKind k, long timeout_us) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+    struct timespec deadline;
+
+    park_deadline(&deadline, timeout_us);
+    int res = send_msg(queue, msg, level_of(queue, k), &deadline);
+    if (res == 0) event_notify(&queue->message_sent, 1);
+    return res;
+}
+
+int aq_recv_timeout(AlarmQueue aq, void **msg, long timeout_us) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+    struct timespec deadline;
+
+    park_deadline(&deadline, timeout_us);
+    int kind = recv_msg(queue, msg, &deadline);
+    if (kind >= 0) event_notify(&queue->room_made, INT_MAX);
+    return kind;
+}
+
+/*
+ * Alarms of a batch are posted before its normal messages, and receivers
+ * are notified once for the whole batch.  Normal messages stop at the
+ * first one that cannot be queued.
+ */
+int aq_send_batch(AlarmQueue aq, void **msgs, MsgKind *kinds, int n) {
+    if (aq == NULL) return AQ_UNINIT;
+    if (n <= 0) return 0;
+    if (msgs == NULL) return AQ_NULL_MSG;
+
+    Queue *queue = aq;
+    int i, sent = 0;
+
+    for (i = 0; i < n; i++) {
+        if (msgs[i] == NULL) return AQ_NULL_MSG;
+    }
+
+    if (kinds != NULL) {
+        for (i = 0; i < n; i++) {
+            if (kinds[i] == AQ_ALARM && send_msg(queue, msgs[i], ALARM_LEVEL, NULL) == 0) sent++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (kinds != NULL && kinds[i] == AQ_ALARM) continue;
+        if (send_msg(queue, msgs[i], queue->defaultLevel, NULL) != 0) break;
+        sent++;
+    }
+
+    if (sent > 0) event_notify(&queue->message_sent, sent);
+    return sent;
+}
+
+int aq_recv_batch(AlarmQueue aq, void **out, int max, MsgKind *kinds_out) {
+    if (out == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+    if (max <= 0) return 0;
+
+    Queue *queue = aq;
+    int n = 0, kind;
+
+    kind = recv_msg(queue, &out[n], NULL);
+    do {
+        if (kinds_out != NULL) kinds_out[n] = kind;
+        n++;
+    } while (n < max && (kind = pop_msg(queue, &out[n])) >= 0);
+
+    event_notify(&queue->room_made, INT_MAX);
+    return n;
+}
+
+void aq_set_aging(AlarmQueue aq, int limit) {
+    Queue *queue = aq;
+    __atomic_store_n(&queue->aging, limit > 0 ? limit : 0, __ATOMIC_RELAXED);
+}
+
+void aq_set_spin(AlarmQueue aq, int max_spin) {
+    Queue *queue = aq;
+    park_init(&queue->waitPolicy, max_spin);
+}
+
+void aq_wait_stats(AlarmQueue aq, long *spun, long *parked) {
+    Queue *queue = aq;
+    *spun = __atomic_load_n(&queue->waitPolicy.spun, __ATOMIC_RELAXED);
+    *parked = __atomic_load_n(&queue->waitPolicy.parked, __ATOMIC_RELAXED);
+}
+
+int aq_size(AlarmQueue aq) {
+    Queue *queue = aq;
+    return __atomic_load_n(&queue->size, __ATOMIC_RELAXED);
+}
+
+int aq_alarms(AlarmQueue aq) {
+    Queue *queue = aq;
+    return __atomic_load_n(&queue->alarmMsg, __ATOMIC_RELAXED) != NULL;
+}
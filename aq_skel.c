@@ -11,6 +11,18 @@ AlarmQueue aq_create( ) {
   return NULL;
 }
 
+AlarmQueue aq_create_bounded( int capacity) {
+  return NULL;
+}
+
+AlarmQueue aq_create_prio( int levels) {
+  return NULL;
+}
+
+int aq_destroy( AlarmQueue aq) {
+  return AQ_NOT_IMPL;
+}
+
 int aq_send( AlarmQueue aq, void * msg, MsgKind k){
   return AQ_NOT_IMPL;
 }
@@ -19,6 +31,45 @@ int aq_recv( AlarmQueue aq, void * * msg) {
   return AQ_NOT_IMPL;
 }
 
+int aq_send_prio( AlarmQueue aq, void * msg, int prio) {
+  return AQ_NOT_IMPL;
+}
+
+void aq_set_aging( AlarmQueue aq, int limit) {
+}
+
+int aq_try_send( AlarmQueue aq, void * msg, MsgKind k) {
+  return AQ_NOT_IMPL;
+}
+
+int aq_try_recv( AlarmQueue aq, void * * msg) {
+  return AQ_NOT_IMPL;
+}
+
+int aq_send_timeout( AlarmQueue aq, void * msg, MsgKind k, long timeout_us) {
+  return AQ_NOT_IMPL;
+}
+
+int aq_recv_timeout( AlarmQueue aq, void * * msg, long timeout_us) {
+  return AQ_NOT_IMPL;
+}
+
+int aq_send_batch( AlarmQueue aq, void * * msgs, MsgKind * kinds, int n) {
+  return AQ_NOT_IMPL;
+}
+
+int aq_recv_batch( AlarmQueue aq, void * * out, int max, MsgKind * kinds_out) {
+  return AQ_NOT_IMPL;
+}
+
+void aq_set_spin( AlarmQueue aq, int max_spin) {
+}
+
+void aq_wait_stats( AlarmQueue aq, long * spun, long * parked) {
+  *spun = 0;
+  *parked = 0;
+}
+
 int aq_size( AlarmQueue aq) {
   return 0;
 }
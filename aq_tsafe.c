@@ -3,161 +3,487 @@
  * @Author 02335 team
  * @date   October, 2024
  * @brief  Alarm queue implementation - FIXED v3
+ *
+ * The queue is split into an alarm slot and one FIFO of normal messages
+ * per priority level, each kept with head and tail pointers.  A bitmap
+ * of non-empty levels finds the highest one, so both send and receive
+ * are O(1).  Nodes for the FIFO are recycled through a per-queue
+ * freelist guarded by the queue lock.  Receivers spin on the lock-free
+ * size counter for a while before they take the lock, and if the queue
+ * is still empty they park on a futex with the lock released.
  */
 
 #include "aq.h"
+#include "park.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <pthread.h>
 
 
+#define ALARM_LEVEL  -1   // Level used internally for the alarm slot
+
 typedef struct queueNode {
     void *msg;
-    MsgKind msgKind;
     struct queueNode *next;
 } queueNode;
 
+typedef struct Lane {
+    queueNode *head;           // Oldest normal message
+    queueNode *tail;           // Newest normal message
+} Lane;
+
 typedef struct Queue {
-    queueNode *head;
+    Lane *lanes;               // One per priority level, 0 is highest
+    int levels;
+    int defaultLevel;          // Level of messages sent as AQ_NORMAL
+    unsigned int nonEmpty;     // Bit per non-empty level
+    int aging;                 // Bypass limit before serving a lower level, 0 if off
+    int bypassed;              // Receives that passed over lower non-empty levels
+    int aged;                  // Level last served by aging, -1 if none
+    queueNode *freeList;       // Recycled nodes
+    void *alarmMsg;            // Alarm lane (valid if alarmEnqueued)
     int alarmEnqueued;
+    int size;                  // Messages of both kinds, readable without lock
+    int capacity;              // Max normal messages, 0 if unbounded
+    ParkPolicy waitPolicy;     // Spinning of receivers before parking
+    int sentEpoch;             // Futex word receivers park on
+    int sleepers;              // Receivers parked on it
     pthread_mutex_t lock;
     pthread_cond_t alarm_received;
-    pthread_cond_t message_sent;
+    pthread_cond_t room_made;
 } Queue;
 
-queueNode *createQueueNode(void *msg, MsgKind k) {
-    queueNode *newQueueNode = malloc(sizeof(queueNode));
-    newQueueNode->msg = msg;
-    newQueueNode->msgKind = k;
-    newQueueNode->next = NULL;
-    return newQueueNode;
-}
-
-void insertAtEnd(queueNode **head, void *msg, MsgKind k) {
-    queueNode *newQueueNode = createQueueNode(msg, k);
-    if (*head == NULL) {
-        *head = newQueueNode;
-        return;
-    }
-    queueNode *temp = *head;
-    while (temp->next != NULL) {
-        temp = temp->next;
-    }
-    temp->next = newQueueNode;
-}
-
-int deleteNode(queueNode **head, int msgContent, void **msg) {
-    queueNode **tempP = head;
-    queueNode *temp = *head;
-    while (temp != NULL) {
-        if (*(int *) temp->msg == msgContent) {
-            MsgKind retval = temp->msgKind;
-            *msg = temp->msg;
-            *tempP = temp->next;
-            free(temp);
-            return retval;
-        }
-        tempP = &temp->next;
-        temp = temp->next;
+/*
+ * Waiting.  A NULL deadline waits forever, NO_WAIT does not wait at all.
+ */
+static const struct timespec no_wait;
+#define NO_WAIT (&no_wait)
+
+// Returns 0 when woken, ETIMEDOUT when the deadline has passed
+static int waitOn(Queue *queue, pthread_cond_t *cond, const struct timespec *deadline) {
+    if (deadline == NULL) return pthread_cond_wait(cond, &queue->lock);
+    if (deadline == NO_WAIT) return ETIMEDOUT;
+    return pthread_cond_timedwait(cond, &queue->lock, deadline);
+}
+
+static int hasMessage(void *arg) {
+    Queue *queue = arg;
+    return __atomic_load_n(&queue->size, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Spin before taking the lock if the queue is empty
+static void spinForMessage(Queue *queue) {
+    if (!hasMessage(queue)) park_spin(&queue->waitPolicy, hasMessage, queue);
+}
+
+/*
+ * Receivers park on sentEpoch with the lock released.  Senders move it on
+ * under the lock, and only make the wake-up call if a receiver is parked.
+ * Both must be called with the queue lock held.
+ */
+static void wakeReceivers(Queue *queue, int n) {
+    if (queue->sleepers > 0) {
+        __atomic_store_n(&queue->sentEpoch, queue->sentEpoch + 1, __ATOMIC_RELEASE);
+        park_wake(&queue->sentEpoch, n);
     }
-    return -1;
 }
 
-AlarmQueue aq_create() {
+// Returns 0 when woken, ETIMEDOUT when the deadline has passed
+static int waitForMessage(Queue *queue, const struct timespec *deadline) {
+    int epoch = queue->sentEpoch, res;
+
+    if (deadline == NO_WAIT) return ETIMEDOUT;
+    queue->sleepers++;
+    pthread_mutex_unlock(&queue->lock);
+    res = park_wait(&queue->sentEpoch, epoch, deadline);
+    pthread_mutex_lock(&queue->lock);
+    queue->sleepers--;
+    return res;
+}
+
+/*
+ * Level served by aging: the first non-empty level below the one aging
+ * served last, wrapping around to the first below the highest, top.  The
+ * lower levels thus take turns, and none of them is starved.
+ */
+static int agedLevel(unsigned int nonEmpty, int top, int aged) {
+    unsigned int lower = nonEmpty & ~((2u << top) - 1);
+    unsigned int after = aged < 0 ? lower : lower & ~((2u << aged) - 1);
+    return __builtin_ctz(after != 0 ? after : lower);
+}
+
+/* Node recycling.  Must be called with the queue lock held. */
+static queueNode *allocNode(Queue *queue) {
+    queueNode *node = queue->freeList;
+    if (node != NULL) {
+        queue->freeList = node->next;
+        return node;
+    }
+    return malloc(sizeof(queueNode));
+}
+
+static void freeNode(Queue *queue, queueNode *node) {
+    node->next = queue->freeList;
+    queue->freeList = node;
+}
+
+static Queue *createQueue(int levels, int capacity) {
     Queue *aq = malloc(sizeof(Queue));
     if (aq != NULL) {
-        aq->head = NULL;
+        aq->lanes = calloc(levels, sizeof(Lane));
+        if (aq->lanes == NULL) {
+            free(aq);
+            return NULL;
+        }
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+        aq->levels = levels;
+        aq->defaultLevel = levels / 2;
+        aq->nonEmpty = 0;
+        aq->aging = 0;
+        aq->bypassed = 0;
+        aq->aged = -1;
+        aq->freeList = NULL;
+        aq->alarmMsg = NULL;
         aq->alarmEnqueued = 0;
+        aq->size = 0;
+        aq->capacity = capacity;
+        park_init(&aq->waitPolicy, -1);
+        aq->sentEpoch = 0;
+        aq->sleepers = 0;
         pthread_mutex_init(&(aq->lock), NULL);
-        pthread_cond_init(&(aq->alarm_received), NULL);
-        pthread_cond_init(&(aq->message_sent), NULL);
+        pthread_cond_init(&(aq->alarm_received), &attr);
+        pthread_cond_init(&(aq->room_made), &attr);
+        pthread_condattr_destroy(&attr);
         return aq;
     }
     return NULL;
 }
 
-int aq_send(AlarmQueue aq, void *msg, MsgKind k) {
-    if (msg == NULL) return AQ_NULL_MSG;
-    if (aq == NULL) return AQ_UNINIT;
+AlarmQueue aq_create() {
+    return createQueue(1, 0);
+}
+
+AlarmQueue aq_create_bounded(int capacity) {
+    if (capacity <= 0) return NULL;
+    return createQueue(1, capacity);
+}
+
+AlarmQueue aq_create_prio(int levels) {
+    if (levels <= 0 || levels > AQ_MAX_LEVELS) return NULL;
+    return createQueue(levels, 0);
+}
 
+int aq_destroy(AlarmQueue aq) {
+    if (aq == NULL) return AQ_UNINIT;
     Queue *queue = aq;
+    queueNode *node;
 
-    pthread_mutex_lock(&queue->lock);
+    for (int l = 0; l < queue->levels; l++) {
+        while ((node = queue->lanes[l].head) != NULL) {
+            queue->lanes[l].head = node->next;
+            free(node);
+        }
+    }
+    while ((node = queue->freeList) != NULL) {
+        queue->freeList = node->next;
+        free(node);
+    }
+    pthread_cond_destroy(&queue->room_made);
+    pthread_cond_destroy(&queue->alarm_received);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->lanes);
+    free(queue);
+    return 0;
+}
+
+/*
+ * Lane operations.  Must be called with the queue lock held.
+ */
+static int normalFull(Queue *queue) {
+    return queue->capacity > 0 && queue->size - queue->alarmEnqueued >= queue->capacity;
+}
+
+static int enqueueNormal(Queue *queue, void *msg, int level, const struct timespec *deadline) {
+    // Wait until there is room in the normal lane
+    while (normalFull(queue)) {
+        if (waitOn(queue, &queue->room_made, deadline) == ETIMEDOUT && normalFull(queue)) {
+            return AQ_NO_ROOM;
+        }
+    }
+    queueNode *node = allocNode(queue);
+    if (node == NULL) return AQ_NO_ROOM;
+    node->msg = msg;
+    node->next = NULL;
+
+    Lane *lane = &queue->lanes[level];
+    if (lane->tail == NULL) {
+        lane->head = node;
+        queue->nonEmpty |= 1u << level;
+    } else {
+        lane->tail->next = node;
+    }
+    lane->tail = node;
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    // If sending an alarm, wait until no alarm exists in queue
-    if (k == AQ_ALARM) {
-        while (queue->alarmEnqueued) {
-            pthread_cond_wait(&queue->alarm_received, &queue->lock);
+static int enqueueAlarm(Queue *queue, void *msg, const struct timespec *deadline) {
+    // Wait until the alarm slot is free
+    while (queue->alarmEnqueued) {
+        if (waitOn(queue, &queue->alarm_received, deadline) == ETIMEDOUT && queue->alarmEnqueued) {
+            return AQ_NO_ROOM;
         }
-        queue->alarmEnqueued = 1;  // Mark alarm as enqueued
     }
+    queue->alarmMsg = msg;
+    __atomic_store_n(&queue->alarmEnqueued, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    insertAtEnd(&queue->head, msg, k);
+// Queue must be non-empty.  Alarms are always delivered before normal messages.
+static int dequeue(Queue *queue, void **msg) {
+    int kind;
+
+    if (queue->alarmEnqueued) {
+        *msg = queue->alarmMsg;
+        queue->alarmMsg = NULL;
+        __atomic_store_n(&queue->alarmEnqueued, 0, __ATOMIC_RELAXED);
+        kind = AQ_ALARM;
+
+        // Signal that alarm slot is now free
+        pthread_cond_signal(&queue->alarm_received);
+    } else {
+        int level = __builtin_ctz(queue->nonEmpty);
+
+        // Aging: now and then serve a lower non-empty level first
+        if (queue->aging > 0 && (queue->nonEmpty >> level) > 1 &&
+            ++queue->bypassed >= queue->aging) {
+            queue->bypassed = 0;
+            level = queue->aged = agedLevel(queue->nonEmpty, level, queue->aged);
+        }
+
+        Lane *lane = &queue->lanes[level];
+        queueNode *node = lane->head;
+        *msg = node->msg;
+        lane->head = node->next;
+        if (lane->head == NULL) {
+            lane->tail = NULL;
+            queue->nonEmpty &= ~(1u << level);
+        }
+        freeNode(queue, node);
+        kind = AQ_NORMAL;
+
+        if (queue->capacity > 0) pthread_cond_signal(&queue->room_made);
+    }
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
+    return kind;
+}
+
+// Level is ALARM_LEVEL for alarms
+static int sendMsg(Queue *queue, void *msg, int level, const struct timespec *deadline) {
+    int res;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (level == ALARM_LEVEL) {
+        res = enqueueAlarm(queue, msg, deadline);
+    } else {
+        res = enqueueNormal(queue, msg, level, deadline);
+    }
 
     // Signal that a message is available
-    pthread_cond_signal(&queue->message_sent);
+    if (res == 0) wakeReceivers(queue, 1);
 
     pthread_mutex_unlock(&queue->lock);
-    return 0;
+    return res;
 }
 
-int aq_recv(AlarmQueue aq, void **msg) {
-    if (msg == NULL) return AQ_NULL_MSG;
-    if (aq == NULL) return AQ_UNINIT;
+static int recvMsg(Queue *queue, void **msg, const struct timespec *deadline) {
+    int kind = AQ_NO_MSG;
 
-    Queue *queue = aq;
+    if (deadline != NO_WAIT) spinForMessage(queue);
 
     pthread_mutex_lock(&queue->lock);
 
     // Wait until at least one message is available
-    while (queue->head == NULL) {
-        pthread_cond_wait(&queue->message_sent, &queue->lock);
+    if (queue->size == 0 && deadline != NO_WAIT) park_slept(&queue->waitPolicy);
+    while (queue->size == 0) {
+        if (waitForMessage(queue, deadline) == ETIMEDOUT) break;
     }
 
-    queueNode *temp = queue->head;
+    if (queue->size > 0) kind = dequeue(queue, msg);
 
-    // Check if queue has alarm msg
-    if (queue->alarmEnqueued) {
+    pthread_mutex_unlock(&queue->lock);
+    return kind;
+}
 
-        int kind = deleteNode(&queue->head, *(int *) temp-> msg, msg);
+static int levelOf(Queue *queue, MsgKind k) {
+    return k == AQ_ALARM ? ALARM_LEVEL : queue->defaultLevel;
+}
 
-        // Clear alarm flag and signal that alarm slot is now free
-        queue->alarmEnqueued = 0;
+int aq_send(AlarmQueue aq, void *msg, MsgKind k) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
 
-        pthread_cond_signal(&queue->alarm_received);
-        pthread_mutex_unlock(&queue->lock);
-        return kind;
+    return sendMsg(aq, msg, levelOf(aq, k), NULL);
+}
+
+int aq_send_prio(AlarmQueue aq, void *msg, int prio) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    Queue *queue = aq;
+    if (prio < 0 || prio >= queue->levels) return AQ_BAD_PRIO;
+    return sendMsg(queue, msg, prio, NULL);
+}
+
+int aq_recv(AlarmQueue aq, void **msg) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    return recvMsg(aq, msg, NULL);
+}
+
+int aq_try_send(AlarmQueue aq, void *msg, MsgKind k) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    return sendMsg(aq, msg, levelOf(aq, k), NO_WAIT);
+}
+
+int aq_try_recv(AlarmQueue aq, void **msg) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    // Avoid the lock altogether when the queue is known to be empty
+    if (aq_size(aq) == 0) return AQ_NO_MSG;
+    return recvMsg(aq, msg, NO_WAIT);
+}
+
+int aq_send_timeout(AlarmQueue aq, void *msg, MsgKind k, long timeout_us) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    struct timespec deadline;
+    park_deadline(&deadline, timeout_us);
+    return sendMsg(aq, msg, levelOf(aq, k), &deadline);
+}
+
+int aq_recv_timeout(AlarmQueue aq, void **msg, long timeout_us) {
+    if (msg == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+
+    struct timespec deadline;
+    park_deadline(&deadline, timeout_us);
+    return recvMsg(aq, msg, &deadline);
+}
+
+/*
+ * Alarms of a batch are posted before its normal messages.  If the sender
+ * has to wait for room, receivers are first woken for the messages
+ * already posted.  Normal messages stop at the first node that cannot be
+ * allocated.
+ */
+int aq_send_batch(AlarmQueue aq, void **msgs, MsgKind *kinds, int n) {
+    if (aq == NULL) return AQ_UNINIT;
+    if (n <= 0) return 0;
+    if (msgs == NULL) return AQ_NULL_MSG;
+
+    Queue *queue = aq;
+    int i, sent = 0;
+
+    for (i = 0; i < n; i++) {
+        if (msgs[i] == NULL) return AQ_NULL_MSG;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (kinds != NULL) {
+        for (i = 0; i < n; i++) {
+            if (kinds[i] != AQ_ALARM) continue;
+            if (queue->alarmEnqueued) {
+                wakeReceivers(queue, INT_MAX);
+            }
+            enqueueAlarm(queue, msgs[i], NULL);
+            sent++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (kinds != NULL && kinds[i] == AQ_ALARM) continue;
+        if (normalFull(queue)) {
+            wakeReceivers(queue, INT_MAX);
+        }
+        if (enqueueNormal(queue, msgs[i], queue->defaultLevel, NULL) != 0) break;
+        sent++;
     }
 
-    // No alarm message found, get first normal message
-    temp = queue->head;
-    int kind = deleteNode(&queue->head, *(int *) temp->msg, msg);
+    if (sent > 0) wakeReceivers(queue, sent);
 
     pthread_mutex_unlock(&queue->lock);
-    return kind;
+    return sent;
 }
 
-// Not sure we need locks on size functions
-// letting them be for now just in case.
-int aq_size(AlarmQueue aq) {
-    int size = 0;
+int aq_recv_batch(AlarmQueue aq, void **out, int max, MsgKind *kinds_out) {
+    if (out == NULL) return AQ_NULL_MSG;
+    if (aq == NULL) return AQ_UNINIT;
+    if (max <= 0) return 0;
+
     Queue *queue = aq;
+    int n = 0;
+
+    spinForMessage(queue);
+
     pthread_mutex_lock(&queue->lock);
 
-    queueNode *temp = queue->head;
+    if (queue->size == 0) park_slept(&queue->waitPolicy);
+    while (queue->size == 0) {
+        waitForMessage(queue, NULL);
+    }
 
-    while (temp != NULL) {
-        size++;
-        temp = temp->next;
+    while (n < max && queue->size > 0) {
+        int kind = dequeue(queue, &out[n]);
+        if (kinds_out != NULL) kinds_out[n] = kind;
+        n++;
     }
+    if (n > 1 && queue->capacity > 0) pthread_cond_broadcast(&queue->room_made);
+
     pthread_mutex_unlock(&queue->lock);
-    return size;
+    return n;
 }
 
-int aq_alarms(AlarmQueue aq) {
+void aq_set_aging(AlarmQueue aq, int limit) {
     Queue *queue = aq;
     pthread_mutex_lock(&queue->lock);
-    int count = queue->alarmEnqueued;
+    queue->aging = limit > 0 ? limit : 0;
     pthread_mutex_unlock(&queue->lock);
-    return count;
-}
\ No newline at end of file
+}
+
+void aq_set_spin(AlarmQueue aq, int max_spin) {
+    Queue *queue = aq;
+    park_init(&queue->waitPolicy, max_spin);
+}
+
+void aq_wait_stats(AlarmQueue aq, long *spun, long *parked) {
+    Queue *queue = aq;
+    *spun = __atomic_load_n(&queue->waitPolicy.spun, __ATOMIC_RELAXED);
+    *parked = __atomic_load_n(&queue->waitPolicy.parked, __ATOMIC_RELAXED);
+}
+
+// Counters are only written under the lock, so a relaxed read gives a
+// consistent (if possibly stale) snapshot without taking it.
+int aq_size(AlarmQueue aq) {
+    Queue *queue = aq;
+    return __atomic_load_n(&queue->size, __ATOMIC_RELAXED);
+}
+
+int aq_alarms(AlarmQueue aq) {
+    Queue *queue = aq;
+    return __atomic_load_n(&queue->alarmEnqueued, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,127 @@
+/**
+ * @file   deque.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Work-stealing deque implementation
+ *
+ * Follows the C11 formulation of the Chase-Lev deque by Le, Pop, Cohen
+ * and Zappa Nardelli (PPoPP 2013).
+ */
+
+/* Implements */
+#include "deque.h"
+
+/* Uses */
+#include <stdlib.h>
+#include <stdio.h>
+
+#define INITIAL_SIZE 256   // Initial number of slots (power of two)
+
+struct DequeArray {
+  long size;
+  DequeArray * next;       // Link in list of retired arrays
+  void * items[];
+};
+
+static DequeArray * array_create(long size) {
+  DequeArray * a = malloc(sizeof(DequeArray) + size * sizeof(void *));
+  if (a == NULL) {
+    printf("ERROR: Deque array could not be allocated\n");
+    exit(1);
+  }
+  a->size = size;
+  a->next = NULL;
+  return a;
+}
+
+void deque_init(Deque * d) {
+  d->top = 0;
+  d->bottom = 0;
+  d->array = array_create(INITIAL_SIZE);
+  d->retired = NULL;
+}
+
+void deque_destroy(Deque * d) {
+  DequeArray * a;
+
+  while ((a = d->retired) != NULL) {
+    d->retired = a->next;
+    free(a);
+  }
+  free(d->array);
+  d->array = NULL;
+}
+
+/* Thieves may still read an outgrown array, so it is retired, not freed */
+static DequeArray * grow(Deque * d, DequeArray * a, long top, long bottom) {
+  DequeArray * b = array_create(a->size * 2);
+  long i;
+
+  for (i = top; i < bottom; i++) {
+    b->items[i & (b->size - 1)] = __atomic_load_n(&a->items[i & (a->size - 1)], __ATOMIC_RELAXED);
+  }
+  a->next = d->retired;
+  d->retired = a;
+  __atomic_store_n(&d->array, b, __ATOMIC_RELEASE);
+  return b;
+}
+
+void deque_push(Deque * d, void * item) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  DequeArray * a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+  if (b - t > a->size - 1) a = grow(d, a, t, b);
+  __atomic_store_n(&a->items[b & (a->size - 1)], item, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+void * deque_take(Deque * d) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray * a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  long t;
+  void * item = NULL;
+
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  if (t <= b) {
+    item = __atomic_load_n(&a->items[b & (a->size - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+      /* Last item: race against thieves for it */
+      if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        item = NULL;
+      }
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+
+void * deque_steal(Deque * d) {
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  void * item = NULL;
+
+  if (t < b) {
+    DequeArray * a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    item = __atomic_load_n(&a->items[t & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+  }
+  return item;
+}
+
+long deque_size(Deque * d) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  return b > t ? b - t : 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file   deque.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Work-stealing deque interface
+ *
+ * A Chase-Lev deque: its owner pushes and takes items at the bottom,
+ * other threads steal them from the top.  Only the owner may call
+ * deque_push and deque_take, any thread may call deque_steal.
+ */
+
+#ifndef DEQUE_H_INCLUDED
+#define DEQUE_H_INCLUDED
+
+typedef struct DequeArray DequeArray;
+
+typedef struct {
+  long top     __attribute__((aligned(64)));
+  long bottom  __attribute__((aligned(64)));
+  DequeArray * array;
+  DequeArray * retired;    // Outgrown arrays, freed with the deque
+} Deque;
+
+/**
+ * @name    deque_init
+ * @brief   Initializes an empty deque
+ */
+void deque_init(Deque * d);
+
+/**
+ * @name    deque_destroy
+ * @brief   Frees the resources of a deque.  No thread may use it afterwards.
+ */
+void deque_destroy(Deque * d);
+
+/**
+ * @name    deque_push
+ * @brief   Pushes item at the bottom of the deque, growing it if needed.
+ *          Owner only.
+ */
+void deque_push(Deque * d, void * item);
+
+/**
+ * @name    deque_take
+ * @brief   Takes the most recently pushed item.  Owner only.
+ * @retval  The item, or NULL if the deque is empty
+ */
+void * deque_take(Deque * d);
+
+/**
+ * @name    deque_steal
+ * @brief   Steals the least recently pushed item.
+ * @retval  The item, or NULL if the deque is empty or the steal lost a race
+ */
+void * deque_steal(Deque * d);
+
+/**
+ * @name    deque_size
+ * @brief   Gives the approximate number of items in the deque
+ */
+long deque_size(Deque * d);
+
+#endif /* DEQUE_H_INCLUDED */
@@ -0,0 +1,864 @@
+/**
+ * @file   dfa.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Regular expression DFA implementation
+ *
+ * The expression is parsed straight into a Thompson NFA.  Deterministic
+ * states are the sets of NFA nodes the search may be at, as in the subset
+ * construction, but each is only built the first time a scan takes a
+ * transition to it.  The start node is added back after every byte, so a
+ * state covers the matches starting at any earlier position.
+ *
+ * Transitions are kept in a table by state and byte class, bytes that no
+ * part of the expression tells apart sharing a class.  Scans read the
+ * table without locking; a missing transition is built under the mutex
+ * and published with a release store, after the state it leads to.
+ *
+ * The table holds at most DFA_MAX_STATES states.  Once it is full, a scan
+ * needing a state not built runs the NFA itself, one set of nodes per
+ * byte, up to the end of the line, and is back on the DFA from the next;
+ * a scan ending within such a line leaves the set behind as a state past
+ * the table.
+ *
+ * As no match contains a newline, every newline leads to the start state,
+ * and a line where the literal every match contains does not occur holds
+ * no match: scans look for the literal with memmem and only run the DFA
+ * over the lines where it occurs.
+ */
+
+#define _GNU_SOURCE              // For memmem and memrchr
+
+/* Implements */
+#include "dfa.h"
+
+/* Uses */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* NFA node types */
+#define NODE_SET   0   // Consumes a byte of its set, then out
+#define NODE_SPLIT 1   // Continues at both out and out1
+#define NODE_EMPTY 2   // Continues at out
+#define NODE_BOL   3   // Continues at out at the start of a line
+#define NODE_EOL   4   // Continues at out at the end of a line
+#define NODE_MATCH 5
+
+#define HASH_SIZE (2 * DFA_MAX_STATES)   // Power of two
+
+typedef struct {
+  uint64_t bits[4];
+} ByteSet;
+
+typedef struct {
+  int type;
+  int out, out1;
+  ByteSet set;
+} Node;
+
+/*
+ * Part of the NFA being built: its start node, and the list of its
+ * dangling edges, threaded through the edges themselves.  An edge is
+ * given as 2 * node + 1 for out1, 2 * node for out; -1 ends the list.
+ */
+typedef struct {
+  int start;
+  int out;
+} Frag;
+
+/* Working space to follow the NFA in */
+typedef struct {
+  int * mark;                // Generation a node was last added in
+  int gen;
+  int * stack;
+  int * scratch;
+} Work;
+
+typedef struct {
+  const char * re;
+  const char * p;            // Next character
+  Node * nodes;
+  int n, size;
+  char * error;
+  int error_size;
+  int failed;
+  int newline;               // The atom being parsed names a newline
+} Parser;
+
+struct Dfa {
+  Node * nodes;
+  int n;
+  int start;                 // Start node
+  char * literal;
+  int literal_length;
+
+  int classes;
+  uint16_t cls[256];         // Class of each byte
+  unsigned char rep[256];    // A byte of each class
+
+  int states;
+  int32_t * rows[DFA_MAX_STATES];      // Next state by class, -1 if not built
+  unsigned char accept[DFA_MAX_STATES];   // A match ends at the last byte
+  unsigned char eol[DFA_MAX_STATES];      // Only if a line ends after it
+
+  /* Used while building states, under the mutex */
+  pthread_mutex_t mutex;
+  int * sets[DFA_MAX_STATES];          // Sorted nodes of each state
+  int set_n[DFA_MAX_STATES];
+  int hash[HASH_SIZE];                 // States by set, -1 if free
+  Work work;
+
+  /* Sets a scan on the NFA ended in, numbered from DFA_MAX_STATES */
+  int ** kept;
+  int * kept_n;
+  unsigned char * kept_eol;
+  int kepts, kept_size;
+};
+
+static void set_add(ByteSet * s, int c) {
+  s->bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+static int set_has(const ByteSet * s, int c) {
+  return (s->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static void set_range(ByteSet * s, int lo, int hi) {
+  for (; lo <= hi; lo++) set_add(s, lo);
+}
+
+static void set_invert(ByteSet * s) {
+  int i;
+  for (i = 0; i < 4; i++) s->bits[i] = ~s->bits[i];
+}
+
+static int set_size(const ByteSet * s) {
+  int i, n = 0;
+  for (i = 0; i < 4; i++) n += __builtin_popcountll(s->bits[i]);
+  return n;
+}
+
+/***************** Parsing ******************/
+
+static void parse_error(Parser * ps, const char * message) {
+  if (ps->failed) return;
+  snprintf(ps->error, ps->error_size, "%s at offset %ld", message, (long) (ps->p - ps->re));
+  ps->failed = 1;
+}
+
+static int add_node(Parser * ps, int type, int out, int out1) {
+  if (ps->n == ps->size) {
+    ps->size = ps->size > 0 ? 2 * ps->size : 64;
+    Node * nodes = realloc(ps->nodes, sizeof(Node) * ps->size);
+    if (nodes == NULL) {
+      parse_error(ps, "Out of memory");
+      return -1;
+    }
+    ps->nodes = nodes;
+  }
+  Node * node = &ps->nodes[ps->n];
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  node->out = out;
+  node->out1 = out1;
+  return ps->n++;
+}
+
+static int * edge(Parser * ps, int e) {
+  return e & 1 ? &ps->nodes[e >> 1].out1 : &ps->nodes[e >> 1].out;
+}
+
+/* Points the dangling edges of list at node target */
+static void patch(Parser * ps, int list, int target) {
+  while (list != -1) {
+    int * e = edge(ps, list);
+    list = *e;
+    *e = target;
+  }
+}
+
+static int append(Parser * ps, int list, int other) {
+  int e = list;
+
+  if (list == -1) return other;
+  while (*edge(ps, e) != -1) e = *edge(ps, e);
+  *edge(ps, e) = other;
+  return list;
+}
+
+/* Fragment of a single node whose out dangles */
+static Frag single(Parser * ps, int type) {
+  Frag f;
+  f.start = add_node(ps, type, -1, -1);
+  f.out = f.start < 0 ? -1 : 2 * f.start;
+  return f;
+}
+
+/* Adds the bytes of escape \c to s */
+static void escape(Parser * ps, int c, ByteSet * s) {
+  ByteSet e = { { 0, 0, 0, 0 } };
+  int invert = c == 'D' || c == 'W' || c == 'S';
+
+  switch (c) {
+  case 'd': case 'D':
+    set_range(&e, '0', '9');
+    break;
+  case 'w': case 'W':
+    set_range(&e, 'a', 'z');
+    set_range(&e, 'A', 'Z');
+    set_range(&e, '0', '9');
+    set_add(&e, '_');
+    break;
+  case 's': case 'S':
+    set_add(&e, ' ');
+    set_range(&e, '\t', '\r');
+    break;
+  case 't': set_add(&e, '\t'); break;
+  case 'n': ps->newline = 1; break;
+  case 'r': set_add(&e, '\r'); break;
+  case '\0':
+    parse_error(ps, "Trailing \\");
+    return;
+  default:
+    set_add(&e, c);
+  }
+  if (invert) set_invert(&e);
+  for (c = 0; c < 4; c++) s->bits[c] |= e.bits[c];
+}
+
+/* Class after its [ */
+static void parse_class(Parser * ps, ByteSet * s) {
+  int invert = 0, lo, hi;
+
+  if (*ps->p == '^') {
+    invert = 1;
+    ps->p++;
+  }
+  do {
+    if (*ps->p == '\0') {
+      parse_error(ps, "Missing ]");
+      return;
+    }
+    if (*ps->p == '\\') {
+      char c = ps->p[1];
+      if (c == '\0') {
+        ps->p++;
+        parse_error(ps, "Missing ]");
+        return;
+      }
+      ps->p += 2;
+      if (strchr("dDwWsS", c) != NULL) {
+        escape(ps, c, s);
+        continue;
+      }
+      lo = c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : (unsigned char) c;
+    } else {
+      lo = (unsigned char) *ps->p++;
+    }
+    hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+      hi = (unsigned char) ps->p[1];
+      ps->p += 2;
+      if (hi < lo) {
+        parse_error(ps, "Invalid range");
+        return;
+      }
+    }
+    if (lo <= '\n' && '\n' <= hi) ps->newline = !invert;
+    set_range(s, lo, hi);
+  } while (*ps->p != ']');
+  ps->p++;
+  if (invert) set_invert(s);
+}
+
+static Frag parse_alt(Parser * ps);
+
+static Frag parse_atom(Parser * ps) {
+  Frag f = { -1, -1 };
+  ByteSet s = { { 0, 0, 0, 0 } };
+  const char * atom = ps->p;
+  char c = *ps->p++;
+
+  ps->newline = c == '\n';
+  switch (c) {
+  case '(':
+    f = parse_alt(ps);
+    if (*ps->p != ')') {
+      parse_error(ps, "Missing )");
+      return f;
+    }
+    ps->p++;
+    return f;
+  case '?': case '*': case '+':
+    ps->p--;
+    parse_error(ps, "Nothing to repeat");
+    return f;
+  case '^':
+    return single(ps, NODE_BOL);
+  case '$':
+    return single(ps, NODE_EOL);
+  case '.':
+    set_invert(&s);
+    break;
+  case '[':
+    parse_class(ps, &s);
+    break;
+  case '\\':
+    escape(ps, *ps->p, &s);
+    if (*ps->p != '\0') ps->p++;
+    break;
+  default:
+    set_add(&s, (unsigned char) c);
+  }
+
+  if (!ps->failed && ps->newline) {
+    ps->p = atom;
+    parse_error(ps, "Newline cannot be matched");
+  }
+  if (ps->failed) return f;
+  f = single(ps, NODE_SET);
+  if (f.start >= 0) {
+    s.bits['\n' >> 6] &= ~((uint64_t) 1 << ('\n' & 63));   // Left out of . [^...] \s
+    ps->nodes[f.start].set = s;
+  }
+  return f;
+}
+
+static Frag parse_repeat(Parser * ps) {
+  Frag f = parse_atom(ps);
+  int s;
+
+  while (!ps->failed && (*ps->p == '?' || *ps->p == '*' || *ps->p == '+')) {
+    char op = *ps->p++;
+    if ((s = add_node(ps, NODE_SPLIT, f.start, -1)) < 0) break;
+    if (op == '?') {
+      f.start = s;
+      f.out = append(ps, f.out, 2 * s + 1);
+    } else {
+      patch(ps, f.out, s);
+      if (op == '*') f.start = s;
+      f.out = 2 * s + 1;
+    }
+  }
+  return f;
+}
+
+static Frag parse_concat(Parser * ps) {
+  Frag f = { -1, -1 };
+
+  while (!ps->failed && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+    Frag g = parse_repeat(ps);
+    if (ps->failed) break;
+    if (f.start < 0) {
+      f = g;
+    } else {
+      patch(ps, f.out, g.start);
+      f.out = g.out;
+    }
+  }
+  if (f.start < 0 && !ps->failed) f = single(ps, NODE_EMPTY);
+  return f;
+}
+
+static Frag parse_alt(Parser * ps) {
+  Frag f = parse_concat(ps);
+  int s;
+
+  while (!ps->failed && *ps->p == '|') {
+    ps->p++;
+    Frag g = parse_concat(ps);
+    if (ps->failed || (s = add_node(ps, NODE_SPLIT, f.start, g.start)) < 0) break;
+    f.start = s;
+    f.out = append(ps, f.out, g.out);
+  }
+  return f;
+}
+
+/***************** States ******************/
+
+static int work_init(Work * w, int n) {
+  w->mark = calloc(n, sizeof(int));
+  w->gen = 0;
+  w->stack = malloc(sizeof(int) * (2 * n + 2));
+  w->scratch = malloc(sizeof(int) * (n + 1));
+  return w->mark != NULL && w->stack != NULL && w->scratch != NULL;
+}
+
+static void work_free(Work * w) {
+  free(w->mark);
+  free(w->stack);
+  free(w->scratch);
+}
+
+/*
+ * Adds node i, and the nodes reached from it without consuming a byte, to
+ * set[0..*n-1], passing ^ if bol and $ if eol.  Nodes consuming a byte,
+ * the match and $ are kept in the set.
+ */
+static void closure(const Dfa * d, Work * w, int i, int bol, int eol, int * set, int * n) {
+  int top = 0;
+
+  w->stack[top++] = i;
+  while (top > 0) {
+    i = w->stack[--top];
+    if (i < 0 || w->mark[i] == w->gen) continue;
+    w->mark[i] = w->gen;
+    const Node * node = &d->nodes[i];
+    switch (node->type) {
+    case NODE_SPLIT:
+      w->stack[top++] = node->out1;
+      w->stack[top++] = node->out;
+      break;
+    case NODE_EMPTY:
+      w->stack[top++] = node->out;
+      break;
+    case NODE_BOL:
+      if (bol) w->stack[top++] = node->out;
+      break;
+    case NODE_EOL:
+      set[(*n)++] = i;
+      if (eol) w->stack[top++] = node->out;
+      break;
+    default:
+      set[(*n)++] = i;
+    }
+  }
+}
+
+/* Gives the size of the set after set[0..n-1] reads byte, left in w->scratch */
+static int step(const Dfa * d, Work * w, const int * set, int n, int byte) {
+  int i, m = 0;
+
+  w->gen++;
+  for (i = 0; i < n; i++) {
+    const Node * node = &d->nodes[set[i]];
+    if (node->type == NODE_SET && set_has(&node->set, byte)) {
+      closure(d, w, node->out, 0, 0, w->scratch, &m);
+    }
+  }
+  closure(d, w, d->start, 0, 0, w->scratch, &m);
+  return m;
+}
+
+/* Tells whether set[0..n-1] holds the match */
+static int has_match(const Dfa * d, const int * set, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (d->nodes[set[i]].type == NODE_MATCH) return 1;
+  }
+  return 0;
+}
+
+/* Tells whether a set reaches the match at the end of a line */
+static int matches_at_eol(const Dfa * d, Work * w, const int * set, int n) {
+  int i, m = 0;
+
+  w->gen++;
+  for (i = 0; i < n; i++) {
+    if (d->nodes[set[i]].type == NODE_EOL) closure(d, w, set[i], 0, 1, w->scratch, &m);
+  }
+  return has_match(d, w->scratch, m);
+}
+
+static int compare_ints(const void * a, const void * b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+static unsigned int hash_set(const int * set, int n) {
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+  return h & (HASH_SIZE - 1);
+}
+
+/* Gives the state of sorted set[0..n-1], -1 if it has not been built */
+static int find_state(Dfa * d, const int * set, int n) {
+  unsigned int h;
+  int s;
+
+  for (h = hash_set(set, n); (s = d->hash[h]) >= 0; h = (h + 1) & (HASH_SIZE - 1)) {
+    if (d->set_n[s] == n && memcmp(d->sets[s], set, sizeof(int) * n) == 0) return s;
+  }
+  return -1;
+}
+
+/* Gives the state of set[0..n-1], building it if new, -1 if out of room */
+static int add_state(Dfa * d, int * set, int n) {
+  unsigned int h;
+  int i, s;
+
+  qsort(set, n, sizeof(int), compare_ints);
+  if ((s = find_state(d, set, n)) >= 0) return s;
+  if (d->states == DFA_MAX_STATES) return -1;
+
+  s = d->states;
+  d->rows[s] = malloc(sizeof(int32_t) * d->classes);
+  d->sets[s] = malloc(sizeof(int) * (n > 0 ? n : 1));
+  if (d->rows[s] == NULL || d->sets[s] == NULL) {
+    printf("ERROR: DFA state could not be allocated\n");
+    exit(1);
+  }
+  for (i = 0; i < d->classes; i++) d->rows[s][i] = -1;
+  d->rows[s][d->cls['\n']] = 0;        // Back to the start of a line
+  memcpy(d->sets[s], set, sizeof(int) * n);
+  d->set_n[s] = n;
+  d->accept[s] = has_match(d, set, n);
+  d->eol[s] = !d->accept[s] && matches_at_eol(d, &d->work, set, n);
+  for (h = hash_set(set, n); d->hash[h] >= 0; h = (h + 1) & (HASH_SIZE - 1));
+  d->hash[h] = s;
+  __atomic_store_n(&d->states, s + 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+/*
+ * Builds the transition of state s on bytes of class c, -1 if the state
+ * it leads to is new and DFA_MAX_STATES have been built
+ */
+static int32_t build(Dfa * d, int32_t s, int c) {
+  int32_t t;
+  int n;
+
+  pthread_mutex_lock(&d->mutex);
+  t = d->rows[s][c];
+  if (t < 0) {
+    n = step(d, &d->work, d->sets[s], d->set_n[s], d->rep[c]);
+    int * next = malloc(sizeof(int) * (n > 0 ? n : 1));
+    if (next == NULL) {
+      printf("ERROR: DFA state could not be allocated\n");
+      exit(1);
+    }
+    memcpy(next, d->work.scratch, sizeof(int) * n);
+    t = add_state(d, next, n);
+    free(next);
+    if (t >= 0) __atomic_store_n(&d->rows[s][c], t, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return t;
+}
+
+/*
+ * Gives the state of a scan ending in set[0..n-1] on the NFA: the DFA
+ * state if built, otherwise the set is kept, once, past DFA_MAX_STATES.
+ * Only scans ending within a line that outgrew the DFA add sets here.
+ */
+static int keep(Dfa * d, int * set, int n) {
+  int k;
+
+  qsort(set, n, sizeof(int), compare_ints);
+  pthread_mutex_lock(&d->mutex);
+  if ((k = find_state(d, set, n)) >= 0) {
+    pthread_mutex_unlock(&d->mutex);
+    return k;
+  }
+  for (k = 0; k < d->kepts; k++) {
+    if (d->kept_n[k] == n && memcmp(d->kept[k], set, sizeof(int) * n) == 0) break;
+  }
+  if (k == d->kepts) {
+    if (d->kepts == d->kept_size) {
+      d->kept_size = d->kept_size > 0 ? 2 * d->kept_size : 16;
+      d->kept = realloc(d->kept, sizeof(int *) * d->kept_size);
+      d->kept_n = realloc(d->kept_n, sizeof(int) * d->kept_size);
+      d->kept_eol = realloc(d->kept_eol, d->kept_size);
+    }
+    if (d->kept == NULL || d->kept_n == NULL || d->kept_eol == NULL ||
+        (d->kept[k] = malloc(sizeof(int) * (n > 0 ? n : 1))) == NULL) {
+      printf("ERROR: NFA state could not be allocated\n");
+      exit(1);
+    }
+    memcpy(d->kept[k], set, sizeof(int) * n);
+    d->kept_n[k] = n;
+    d->kept_eol[k] = !has_match(d, set, n) && matches_at_eol(d, &d->work, set, n);
+    d->kepts++;
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return DFA_MAX_STATES + k;
+}
+
+/***************** Compilation ******************/
+
+/* Tells whether the match is reached from the start without node skip */
+static int reaches(Dfa * d, int skip) {
+  int top = 0, i;
+
+  Work * w = &d->work;
+
+  w->gen++;
+  w->stack[top++] = d->start;
+  while (top > 0) {
+    i = w->stack[--top];
+    if (i < 0 || i == skip || w->mark[i] == w->gen) continue;
+    w->mark[i] = w->gen;
+    Node * node = &d->nodes[i];
+    if (node->type == NODE_MATCH) return 1;
+    if (node->type == NODE_SPLIT) w->stack[top++] = node->out1;
+    w->stack[top++] = node->out;
+  }
+  return 0;
+}
+
+static int single_byte(const Node * node) {
+  return node->type == NODE_SET && set_size(&node->set) == 1;
+}
+
+static int first_byte(const ByteSet * s) {
+  int c;
+  for (c = 0; !set_has(s, c); c++);
+  return c;
+}
+
+/*
+ * Finds the longest literal every match contains: a run of single byte
+ * nodes, each leading straight to the next, whose first node is on every
+ * path from the start to the match.
+ */
+static int find_literal(Dfa * d) {
+  int i, j, k, best = -1, best_length = 0;
+
+  for (i = 0; i < d->n; i++) {
+    if (!single_byte(&d->nodes[i])) continue;
+    for (k = 0, j = i; j >= 0 && single_byte(&d->nodes[j]) && k < d->n; j = d->nodes[j].out) k++;
+    if (k > best_length && !reaches(d, i)) {
+      best = i;
+      best_length = k;
+    }
+  }
+
+  d->literal = malloc(best_length + 1);
+  if (d->literal == NULL) return 0;
+  for (k = 0, j = best; k < best_length; j = d->nodes[j].out) {
+    d->literal[k++] = first_byte(&d->nodes[j].set);
+  }
+  d->literal[best_length] = '\0';
+  d->literal_length = best_length;
+  return 1;
+}
+
+/* Gives bytes the same class if every node and a newline treat them alike */
+static void find_classes(Dfa * d) {
+  int b, c, i;
+
+  d->classes = 0;
+  for (b = 0; b < 256; b++) {
+    for (c = 0; c < d->classes; c++) {
+      int a = d->rep[c];
+      if ((a == '\n') != (b == '\n')) continue;
+      for (i = 0; i < d->n; i++) {
+        const Node * node = &d->nodes[i];
+        if (node->type == NODE_SET && set_has(&node->set, a) != set_has(&node->set, b)) break;
+      }
+      if (i == d->n) break;
+    }
+    if (c == d->classes) d->rep[d->classes++] = b;
+    d->cls[b] = c;
+  }
+}
+
+Dfa * dfa_compile(const char * re, char * error, int size) {
+  Parser ps;
+  Frag f;
+  Dfa * d;
+  int i, n = 0;
+
+  memset(&ps, 0, sizeof(Parser));
+  ps.re = ps.p = re;
+  ps.error = error;
+  ps.error_size = size;
+
+  f = parse_alt(&ps);
+  if (!ps.failed && *ps.p != '\0') parse_error(&ps, "Unmatched )");
+  if (!ps.failed) {
+    int match = add_node(&ps, NODE_MATCH, -1, -1);
+    if (match >= 0) patch(&ps, f.out, match);
+  }
+  if (ps.failed) {
+    free(ps.nodes);
+    return NULL;
+  }
+
+  d = calloc(1, sizeof(Dfa));
+  if (d == NULL) {
+    free(ps.nodes);
+    snprintf(error, size, "Out of memory");
+    return NULL;
+  }
+  d->nodes = ps.nodes;
+  d->n = ps.n;
+  d->start = f.start;
+  for (i = 0; i < HASH_SIZE; i++) d->hash[i] = -1;
+  pthread_mutex_init(&d->mutex, NULL);
+  if (!work_init(&d->work, d->n) || !find_literal(d)) {
+    dfa_destroy(d);
+    snprintf(error, size, "Out of memory");
+    return NULL;
+  }
+
+  d->work.gen++;
+  closure(d, &d->work, d->start, 1, 1, d->work.scratch, &n);
+  if (has_match(d, d->work.scratch, n)) {
+    dfa_destroy(d);
+    snprintf(error, size, "Matches the empty string");
+    return NULL;
+  }
+
+  /* The start state, where every line starts */
+  find_classes(d);
+  n = 0;
+  d->work.gen++;
+  closure(d, &d->work, d->start, 1, 0, d->work.scratch, &n);
+  int * set = malloc(sizeof(int) * (n > 0 ? n : 1));
+  if (set == NULL) {
+    dfa_destroy(d);
+    snprintf(error, size, "Out of memory");
+    return NULL;
+  }
+  memcpy(set, d->work.scratch, sizeof(int) * n);
+  add_state(d, set, n);
+  free(set);
+  return d;
+}
+
+/***************** Scanning ******************/
+
+/*
+ * Runs the NFA over text[*from..end-1] from *state up to the end of the
+ * line, for lines needing more states than the DFA has room for.  Leaves
+ * in *from the position after the line, in *state 0 or, if the text ends
+ * first, the state of the set reached.
+ */
+static long run_nfa(Dfa * d, const char * text, long * from, long end, int * state) {
+  Work w;
+  int * set = malloc(sizeof(int) * (d->n + 1));
+  int n, s = *state;
+  long i, times = 0;
+
+  if (set == NULL || !work_init(&w, d->n)) {
+    printf("ERROR: NFA state could not be allocated\n");
+    exit(1);
+  }
+  if (s < DFA_MAX_STATES) {
+    n = d->set_n[s];
+    memcpy(set, d->sets[s], sizeof(int) * n);
+  } else {
+    pthread_mutex_lock(&d->mutex);
+    n = d->kept_n[s - DFA_MAX_STATES];
+    memcpy(set, d->kept[s - DFA_MAX_STATES], sizeof(int) * n);
+    pthread_mutex_unlock(&d->mutex);
+  }
+
+  for (i = *from; i < end && text[i] != '\n'; i++) {
+    n = step(d, &w, set, n, (unsigned char) text[i]);
+    memcpy(set, w.scratch, sizeof(int) * n);
+    times += has_match(d, set, n);
+  }
+  if (i < end) {
+    times += !has_match(d, set, n) && matches_at_eol(d, &w, set, n);
+    *state = 0;
+    *from = i + 1;
+  } else {
+    *state = keep(d, set, n);
+    *from = end;
+  }
+  work_free(&w);
+  free(set);
+  return times;
+}
+
+/* Runs the DFA over text[from..end-1] from *state */
+static long run(Dfa * d, const char * text, long from, long end, int * state) {
+  int32_t s = *state, t;
+  long i = from, times = 0;
+
+  if (s >= DFA_MAX_STATES) times += run_nfa(d, text, &i, end, &s);
+  while (i < end) {
+    unsigned char c = text[i];
+    t = __atomic_load_n(&d->rows[s][d->cls[c]], __ATOMIC_ACQUIRE);
+    if (t < 0 && (t = build(d, s, d->cls[c])) < 0) {
+      times += run_nfa(d, text, &i, end, &s);   // The DFA is full
+      continue;
+    }
+    times += d->accept[t];
+    if (c == '\n') times += d->eol[s];
+    s = t;
+    i++;
+  }
+  *state = s;
+  return times;
+}
+
+long dfa_count(Dfa * d, const char * text, long length, int * state) {
+  const char * p, * nl;
+  long pos = 0, from, end, times = 0;
+
+  if (d->literal_length == 0) return run(d, text, 0, length, state);
+
+  /* Finish a line started before the text */
+  if (*state != 0) {
+    nl = memchr(text, '\n', length);
+    pos = nl != NULL ? nl - text + 1 : length;
+    times += run(d, text, 0, pos, state);
+  }
+
+  /* At the start of a line from here on */
+  while (pos < length) {
+    p = memmem(text + pos, length - pos, d->literal, d->literal_length);
+    nl = memrchr(text + pos, '\n', (p != NULL ? p : text + length) - (text + pos));
+    from = nl != NULL ? nl - text + 1 : pos;
+    if (p == NULL) {
+      /* No match in the rest, but a line may go on past the text */
+      *state = 0;
+      run(d, text, from, length, state);
+      break;
+    }
+    nl = memchr(p, '\n', text + length - p);
+    end = nl != NULL ? nl - text + 1 : length;
+    *state = 0;
+    times += run(d, text, from, end, state);
+    pos = end;
+  }
+  return times;
+}
+
+int dfa_start(const Dfa * d) {
+  return 0;
+}
+
+int dfa_end(Dfa * d, int state) {
+  int eol;
+
+  if (state < DFA_MAX_STATES) return d->eol[state];
+  pthread_mutex_lock(&d->mutex);
+  eol = d->kept_eol[state - DFA_MAX_STATES];
+  pthread_mutex_unlock(&d->mutex);
+  return eol;
+}
+
+const char * dfa_literal(const Dfa * d) {
+  return d->literal;
+}
+
+int dfa_states(const Dfa * d) {
+  return __atomic_load_n(&d->states, __ATOMIC_ACQUIRE);
+}
+
+void dfa_destroy(Dfa * d) {
+  int i;
+
+  if (d == NULL) return;
+  for (i = 0; i < d->states; i++) {
+    free(d->rows[i]);
+    free(d->sets[i]);
+  }
+  for (i = 0; i < d->kepts; i++) free(d->kept[i]);
+  free(d->kept);
+  free(d->kept_n);
+  free(d->kept_eol);
+  pthread_mutex_destroy(&d->mutex);
+  free(d->nodes);
+  free(d->literal);
+  work_free(&d->work);
+  free(d);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file   dfa.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Regular expression DFA interface
+ *
+ * Regular expressions of the subset:
+ *   c  \c        a byte, escaped if one of  \ . [ ] ( ) | ? * + ^ $
+ *   .            any byte
+ *   [abc] [a-z]  a class of bytes, [^...] its complement
+ *   \d \w \s     digits, word bytes, white space, \D \W \S their complements
+ *   \t \r        tab, carriage return
+ *   r|s (r)      alternation and grouping
+ *   r? r* r+     at most one, any number, at least one r
+ *   ^ $          start and end of a line
+ * are compiled to a Thompson NFA, whose deterministic states are built
+ * lazily as a text is scanned and kept for later scans.  Lines needing
+ * more than DFA_MAX_STATES states are scanned, more slowly, on the NFA.
+ *
+ * Matches do not span lines: no newline is ever matched.  '.', \s and
+ * complemented classes leave it out, and an expression naming one, as
+ * \n, a literal newline or in a class, is not compiled.  A text is
+ * scanned by counting the positions where matches end, so overlapping
+ * matches ending at different positions all count, which for a plain
+ * string is its number of occurrences.  A scan is summed up by the state
+ * where it ends, so a text can be scanned in pieces, and every piece
+ * starting a line starts in the same state, dfa_start.  Any number of
+ * threads may scan with a DFA at once.
+ */
+
+#ifndef DFA_H_INCLUDED
+#define DFA_H_INCLUDED
+
+#define DFA_MAX_STATES 16384   // Deterministic states kept at most
+
+typedef struct Dfa Dfa;
+
+/**
+ * @name    dfa_compile
+ * @brief   Compiles regular expression re.  If it is invalid, names a
+ *          newline or matches the empty string, the reason is left in
+ *          error[0..size-1].
+ * @retval  The DFA, NULL if re could not be compiled
+ */
+Dfa * dfa_compile(const char * re, char * error, int size);
+
+/**
+ * @name    dfa_start
+ * @brief   Gives the state at the start of a line, and of a text
+ */
+int dfa_start(const Dfa * d);
+
+/**
+ * @name    dfa_count
+ * @brief   Scans text[0..length-1] from *state, leaving the state at its
+ *          end in *state.  Lines not containing the literal every match
+ *          contains are skipped over.
+ * @retval  Number of positions where a match ends
+ */
+long dfa_count(Dfa * d, const char * text, long length, int * state);
+
+/**
+ * @name    dfa_end
+ * @brief   Tells whether a match ends at the end of a text whose scan
+ *          ended in state, which only matches ending with $ do
+ * @retval  1 if so, otherwise 0
+ */
+int dfa_end(Dfa * d, int state);
+
+/**
+ * @name    dfa_literal
+ * @brief   Gives the literal every match contains, empty if none
+ */
+const char * dfa_literal(const Dfa * d);
+
+/**
+ * @name    dfa_states
+ * @brief   Gives the number of deterministic states built so far
+ */
+int dfa_states(const Dfa * d);
+
+/**
+ * @name    dfa_destroy
+ * @brief   Frees DFA d
+ */
+void dfa_destroy(Dfa * d);
+
+#endif /* DFA_H_INCLUDED */
@@ -0,0 +1,181 @@
+/**
+ * @file   kernel.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Search kernel implementation
+ *
+ * The vector kernels follow W. Mula's SIMD-friendly substring search: a
+ * position is a candidate if both the first and the last byte of the
+ * pattern match there, which few positions pass in ordinary text, and
+ * only candidates are compared in full.  They are compiled for their
+ * instruction sets with target attributes and picked at run time, so the
+ * program still runs on CPUs without them.
+ */
+
+/* Implements */
+#include "kernel.h"
+
+/* Uses */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+
+#define SHORT_MAX 16   // Longest pattern of the short kernel
+
+const char * const kernel_names[] = {
+  "scalar",
+#ifdef KERNEL_X86
+  "sse2", "avx2", "short",
+#endif
+  "auto", NULL
+};
+
+/* The reference counts every position for an empty pattern */
+#define CHECK_LENGTHS(length, m)            \
+  if ((m) == 0) return (length) + 1;        \
+  if ((length) < (m)) return 0
+
+static long scalar(const char * text, long length, const char * pattern, int m) {
+  long i = 0, last, times = 0;
+  const char * p;
+
+  CHECK_LENGTHS(length, m);
+  last = length - m;
+  while (i <= last && (p = memchr(text + i, pattern[0], last - i + 1)) != NULL) {
+    i = p - text;
+    if (memcmp(p + 1, pattern + 1, m - 1) == 0) times++;
+    i++;
+  }
+  return times;
+}
+
+/* Counts the candidates in mask at positions i + bit that match in full */
+static inline long verify(unsigned int mask, const char * text, long i,
+                          const char * pattern, int m) {
+  long times = 0;
+
+  while (mask != 0) {
+    int bit = __builtin_ctz(mask);
+    if (m <= 2 || memcmp(text + i + bit + 1, pattern + 1, m - 2) == 0) times++;
+    mask &= mask - 1;
+  }
+  return times;
+}
+
+/* Remaining positions i..length-m, one at a time */
+static long tail(const char * text, long i, long length, const char * pattern, int m) {
+  long times = 0;
+
+  for (; i <= length - m; i++) {
+    if (text[i] == pattern[0] && memcmp(text + i + 1, pattern + 1, m - 1) == 0) times++;
+  }
+  return times;
+}
+
+#ifdef KERNEL_X86
+
+__attribute__((target("sse2")))
+static long sse2(const char * text, long length, const char * pattern, int m) {
+  long i, times = 0;
+
+  CHECK_LENGTHS(length, m);
+  const __m128i first = _mm_set1_epi8(pattern[0]);
+  const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+
+  /* Blocks of 16 candidate positions, last bytes within the text */
+  for (i = 0; i + 16 + m - 1 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (text + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (text + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    times += verify(mask, text, i, pattern, m);
+  }
+  return times + tail(text, i, length, pattern, m);
+}
+
+__attribute__((target("avx2")))
+static long avx2(const char * text, long length, const char * pattern, int m) {
+  long i, times = 0;
+
+  CHECK_LENGTHS(length, m);
+  const __m256i first = _mm256_set1_epi8(pattern[0]);
+  const __m256i last = _mm256_set1_epi8(pattern[m - 1]);
+
+  for (i = 0; i + 32 + m - 1 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (text + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (text + i + m - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+    times += verify(mask, text, i, pattern, m);
+  }
+  return times + tail(text, i, length, pattern, m);
+}
+
+/*
+ * Patterns of 1 to SHORT_MAX bytes.  Single bytes are counted with a
+ * population count of the matching positions.  Longer patterns are
+ * filtered as by sse2, and candidates verified by comparing 16 bytes at
+ * once against the pattern, padded to a vector.
+ */
+__attribute__((target("sse2")))
+static long short_pattern(const char * text, long length, const char * pattern, int m) {
+  char padded[16] = { 0 };
+  long i, times = 0;
+
+  CHECK_LENGTHS(length, m);
+  const __m128i first = _mm_set1_epi8(pattern[0]);
+
+  if (m == 1) {
+    for (i = 0; i + 16 <= length; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *) (text + i));
+      times += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, first)));
+    }
+    return times + tail(text, i, length, pattern, m);
+  }
+
+  memcpy(padded, pattern, m);
+  const __m128i whole = _mm_loadu_si128((const __m128i *) padded);
+  const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+  const unsigned int all = (1u << m) - 1;
+
+  /* Verifying loads 16 bytes from each candidate */
+  for (i = 0; i + 16 + 15 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (text + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (text + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+      __m128i c = _mm_loadu_si128((const __m128i *) (text + i + bit));
+      if ((_mm_movemask_epi8(_mm_cmpeq_epi8(c, whole)) & all) == all) times++;
+      mask &= mask - 1;
+    }
+  }
+  return times + tail(text, i, length, pattern, m);
+}
+
+static int has_avx2(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif /* KERNEL_X86 */
+
+Kernel kernel_find(const char * name, int m) {
+  if (strcmp(name, "scalar") == 0) return scalar;
+#ifdef KERNEL_X86
+  if (strcmp(name, "sse2") == 0) return sse2;
+  if (strcmp(name, "avx2") == 0) return has_avx2() ? avx2 : NULL;
+  if (strcmp(name, "short") == 0) return m >= 1 && m <= SHORT_MAX ? short_pattern : NULL;
+  if (strcmp(name, "auto") == 0) {
+    if (m == 1) return short_pattern;
+    return has_avx2() ? avx2 : sse2;
+  }
+#else
+  if (strcmp(name, "auto") == 0) return scalar;
+#endif
+  return NULL;
+}
@@ -0,0 +1,35 @@
+/**
+ * @file   kernel.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Search kernel interface
+ *
+ * Kernels count the occurrences of a pattern in a text, like the reference
+ * search of search.c, but fast.  Occurrences may overlap.
+ */
+
+#ifndef KERNEL_H_INCLUDED
+#define KERNEL_H_INCLUDED
+
+/* Counts the occurrences of pattern[0..m-1] starting in text[0..length-m] */
+typedef long (*Kernel)(const char * text, long length, const char * pattern, int m);
+
+/* Names of the kernels, NULL terminated:
+ *   scalar  memchr for the first byte, then memcmp
+ *   sse2    first and last bytes compared 16 positions at a time
+ *   avx2    first and last bytes compared 32 positions at a time
+ *   short   patterns of 1-16 bytes, verified with a single vector compare
+ *   auto    the best of the above for the pattern and the CPU
+ */
+extern const char * const kernel_names[];
+
+/**
+ * @name    kernel_find
+ * @brief   Gives the kernel named name for patterns of length m, checking
+ *          the CPU for the instructions it needs
+ * @retval  The kernel, or NULL if unknown, unsupported by the CPU, or not
+ *          meant for patterns of length m
+ */
+Kernel kernel_find(const char * name, int m);
+
+#endif /* KERNEL_H_INCLUDED */
@@ -0,0 +1,113 @@
+/**
+ * @file   park.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Adaptive spin-then-park waiting implementation
+ */
+
+/* Implements */
+#include "park.h"
+
+/* Uses */
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define MIN_SPIN    16     // Budget never shrinks below this (unless disabled)
+#define YIELDS       4     // Yields between spinning and parking
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+void park_init(ParkPolicy * p, int max_spin) {
+  if (max_spin < 0) {
+    max_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PARK_DEFAULT_SPIN : 0;
+  }
+  p->max_spin = max_spin;
+  p->spin = max_spin < MIN_SPIN ? max_spin : MIN_SPIN;
+  p->spun = 0;
+  p->parked = 0;
+}
+
+int park_spin(ParkPolicy * p, int (*ready)(void *), void * arg) {
+  int max_spin = __atomic_load_n(&p->max_spin, __ATOMIC_RELAXED);
+  int budget = __atomic_load_n(&p->spin, __ATOMIC_RELAXED);
+  int i;
+
+  for (i = 0; i < budget; i++) {
+    if (ready(arg)) {
+      /* Aim for twice the observed wait, smoothed over recent waits */
+      int target = 2 * i + MIN_SPIN;
+      if (target > max_spin) target = max_spin;
+      __atomic_store_n(&p->spin, (budget + target) / 2, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&p->spun, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+    cpu_relax();
+  }
+
+  for (i = 0; i < YIELDS; i++) {
+    sched_yield();
+    if (ready(arg)) {
+      /* Spinning was almost enough, grow the budget */
+      int target = 2 * budget + MIN_SPIN;
+      if (target > max_spin) target = max_spin;
+      __atomic_store_n(&p->spin, target, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&p->spun, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+
+  /* Spinning was wasted, shrink the budget */
+  budget /= 2;
+  if (budget < MIN_SPIN) budget = max_spin < MIN_SPIN ? max_spin : MIN_SPIN;
+  __atomic_store_n(&p->spin, budget, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void park_slept(ParkPolicy * p) {
+  __atomic_fetch_add(&p->parked, 1, __ATOMIC_RELAXED);
+}
+
+void park_deadline(struct timespec * deadline, long timeout_us) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  if (timeout_us < 0) timeout_us = 0;
+  deadline->tv_sec += timeout_us / 1000000;
+  deadline->tv_nsec += (timeout_us % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+int park_wait(int * word, int value, const struct timespec * deadline) {
+  struct timespec now, rel;
+
+  if (deadline == NULL) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    return 0;
+  }
+
+  /* FUTEX_WAIT takes a relative timeout */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rel.tv_sec = deadline->tv_sec - now.tv_sec;
+  rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+  if (rel.tv_nsec < 0) {
+    rel.tv_sec--;
+    rel.tv_nsec += 1000000000;
+  }
+  if (rel.tv_sec < 0) return ETIMEDOUT;
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, &rel, NULL, 0);
+  return 0;
+}
+
+void park_wake(int * word, int n) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
@@ -0,0 +1,71 @@
+/**
+ * @file   park.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Adaptive spin-then-park waiting
+ *
+ * A waiter first spins for a bounded number of iterations with a pause
+ * instruction, then yields the CPU a few times, and only then parks on a
+ * futex.  The spin budget follows the recently observed wait times:
+ * waits satisfied while spinning grow it, waits that had to park shrink it.
+ */
+
+#ifndef PARK_H_INCLUDED
+#define PARK_H_INCLUDED
+
+#include <time.h>
+
+#define PARK_DEFAULT_SPIN  4000   // Default upper bound on spin iterations
+
+typedef struct {
+  int max_spin;      // Upper bound on the spin budget, 0 disables spinning
+  int spin;          // Current adaptive spin budget
+  long spun;         // Waits satisfied while spinning or yielding
+  long parked;       // Waits that really parked, see park_slept
+} ParkPolicy;
+
+/**
+ * @name    park_init
+ * @brief   Initializes a waiting policy.  A negative max_spin selects the
+ *          default, which is no spinning on a single CPU machine.
+ */
+void park_init(ParkPolicy * p, int max_spin);
+
+/**
+ * @name    park_spin
+ * @brief   Spins, then yields, until ready(arg) holds or the budget runs out.
+ *          The outcome is used to adapt the budget, and a wait satisfied
+ *          is counted as spun.
+ * @retval  1 if ready(arg) became true, 0 if the caller should park.
+ */
+int park_spin(ParkPolicy * p, int (*ready)(void *), void * arg);
+
+/**
+ * @name    park_slept
+ * @brief   Counts a wait that had to park.  Waiters call it once per wait,
+ *          when they are about to park, not when park_spin gives up, as
+ *          what they wait for may still turn up before that.
+ */
+void park_slept(ParkPolicy * p);
+
+/**
+ * @name    park_deadline
+ * @brief   Sets deadline to timeout_us microseconds from now (CLOCK_MONOTONIC).
+ */
+void park_deadline(struct timespec * deadline, long timeout_us);
+
+/**
+ * @name    park_wait
+ * @brief   Parks on the futex word as long as it holds value, until woken or
+ *          until deadline (NULL: no deadline) has passed.
+ * @retval  0 if woken (possibly spuriously), ETIMEDOUT if the deadline passed.
+ */
+int park_wait(int * word, int value, const struct timespec * deadline);
+
+/**
+ * @name    park_wake
+ * @brief   Wakes up to n threads parked on the futex word.
+ */
+void park_wake(int * word, int n);
+
+#endif /* PARK_H_INCLUDED */
@@ -1,106 +1,1496 @@
-
-/** 
- * Implementation of a simple thread pool to which tasks may be submitted for 
+/**
+ * Implementation of a simple thread pool to which tasks may be submitted for
  * concurrent and potentially parallel execution.
+ *
+ * Pools are instances created with pool_create; the pool_init/pool_submit
+ * family operates on a default instance.  Each pool has its own task queue
+ * and workers, so a pool of blocking work cannot starve a CPU-bound one.
+ *
+ * In work-stealing mode each worker owns a deque.  Tasks submitted from
+ * inside a worker go to its own deque, external submissions go through the
+ * task queue, which then serves as injection queue.  Idle workers steal from
+ * random victims and park on an event count when there is nothing to do.
+ *
+ * The pool is shrunk by sending retire alarms over the task queue: the
+ * worker receiving one hands back its queued tasks and exits, and is then
+ * joined.  Retired workers are kept as spares for later growth, since
+ * thieves may still hold a pointer to them.  pool_destroy retires all of
+ * them the same way.
+ *
+ * Workers may be pinned to CPUs picked from the sysfs topology.  On machines
+ * with several NUMA nodes each node also gets a queue for tasks submitted
+ * near it.  Such a task is announced by a near token over the task queue,
+ * so it is found by blocked workers too: whoever gets the token takes a
+ * task from its own node's queue, or else from any other.  Pinned workers
+ * also look in their own node's queue before the task queue.
  */
 
+#define _GNU_SOURCE              // For pthread_setaffinity_np
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
 
 /* Implements */
 #include "pool.h"
 
 /* Uses */
 #include "aq.h"
+#include "deque.h"
+#include "park.h"
+#include "wheel.h"
+#include "topo.h"
+
+
+#define WORKER_BATCH 8   // Max tasks pulled from the queue at a time
+#define PRIO_AGING  16   // Higher priority tasks started before a lower one gets a turn
+#define MAX_WORKERS 256  // Max number of worker threads
+
+#define COMPENSATE_POLL_US   10000   // Idle compensating workers check if still needed
+
+#define TIMER_TICK_US         1000   // Resolution of delayed and periodic submissions
+
+#define AUTOSCALE_PERIOD_US  10000   // Autoscaler sampling period
+#define AUTOSCALE_IDLE_SAMPLES  50   // Idle samples in a row before shrinking
+
+typedef struct Worker {
+  pthread_t thread;
+  int id;
+  int retiring;          // Retire alarms received, exit once back in the loop
+  int retired;           // Set by the worker when it exits
+  int compensating;      // Stands in for a blocked worker, see pool_blocking_begin
+  int node;              // NUMA node the worker is pinned to, -1 if not pinned
+  Pool * pool;           // Pool the worker belongs to
+  Deque deque;           // Own tasks in work-stealing mode
+  Task * batch[WORKER_BATCH];   // Tasks pulled from the queue, not yet run
+  int batch_next, batch_n;
+  unsigned int seed;     // For picking victims
+  struct Worker * next;  // Link in list of spare workers
+} Worker;
+
+/* Pending delayed or periodic submission of a task */
+typedef struct Timer {
+  WheelNode node;
+  Task * task;
+  unsigned long period;  // Ticks between submissions, 0 if submitted once
+  int submitted;         // Submitted at least once
+} Timer;
+
+struct Pool {
+  AlarmQueue task_queue;
+  int workers;
+  Worker * worker_list[MAX_WORKERS];
+  int stealing;
+
+  /* Idle workers park on this event count in work-stealing mode */
+  int idle_epoch;
+  int idle_waiters;
+
+  int idle_workers;            // Workers currently without a task
+  int retired_count;           // Futex word counting retirements
+  Worker * spare_workers;      // Retired workers, for reuse
+
+  /* Draining */
+  int pending;                 // Futex word counting tasks not yet completed
+  int drain_waiters;
 
+  /* Compensation of blocked workers */
+  int blocked;                 // Workers in blocking calls
+  int compensators;            // Compensating workers wanted
+  int compensator_threads;     // Futex word counting live compensating workers
+  int max_compensators;
 
-/* Worker prototype */
-void * worker(void *);  
+  /* Timers, serviced by a thread started on first use */
+  Wheel wheel;
+  pthread_t timer_thread;
+  int timing;
+  struct timespec timer_start;       // Time of tick 0
+  pthread_mutex_t timer_mutex;
+  pthread_cond_t timer_changed;
 
-static AlarmQueue task_queue;
+  /* Placement of workers */
+  int affinity;                      // POOL_AFFINITY_*
+  int cpu_count;                     // CPUs to place workers on, in order
+  int cpu_order[TOPO_MAX_CPUS];
+  int cpu_node[TOPO_MAX_CPUS];
+  int nodes;                         // NUMA nodes, queues only if more than one
+  AlarmQueue node_queues[TOPO_MAX_NODES];
 
-static int workers = 0;
+  /* Autoscaler */
+  pthread_t scaler;
+  int scaling;
+  int scale_min, scale_max;
+
+  /* Protection of pool operations */
+  pthread_mutex_t mutex;
+};
+
+/* Worker prototypes */
+void * worker(void *);
+static void * stealing_worker(Worker * w);
+static int help(void);
+static void retire(Worker * w);
+
+/* Alarm message asking the receiving worker to retire */
+static char retire_token;
+#define RETIRE ((void *) &retire_token)
+
+/* Task message announcing a task in one of the node queues */
+static char near_token;
+#define NEAR ((void *) &near_token)
+
+/* Task message announcing a task in a worker's deque in non-stealing mode */
+static char steal_token;
+#define STEAL ((void *) &steal_token)
+
+/* The worker run by the current thread, if any */
+static __thread Worker * self = NULL;
+
+/* Instance used by the pool_init/pool_submit family */
+static Pool * default_pool = NULL;
+static pthread_mutex_t default_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Creates a worker, or revives a spare one.  Called with the mutex held. */
+static Worker * new_worker(Pool * p, int id) {
+  Worker * w = p->spare_workers;
+
+  if (w != NULL) {
+    p->spare_workers = w->next;
+  } else {
+    w = malloc(sizeof(Worker));
+    if (w == NULL) {
+      printf("ERROR: Thread pool could not allocate worker\n");
+      exit(1);
+    }
+    deque_init(&w->deque);
+  }
+  w->id = id;
+  w->retiring = 0;
+  w->retired = 0;
+  w->compensating = 0;
+  w->node = -1;
+  w->batch_next = w->batch_n = 0;
+  w->seed = 2463534242u + id * 7919u;
+  w->pool = p;
+  w->next = NULL;
+  return w;
+}
 
 /*
- * Protection of pool operations
+ * Pins w to the CPU of its id in the placement order, or lets it run on
+ * any CPU without an affinity policy.  Called with the mutex held.
  */
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static void pin(Pool * p, Worker * w) {
+  cpu_set_t set;
+  int i, node = -1;
+
+  CPU_ZERO(&set);
+  if (p->affinity == POOL_AFFINITY_NONE || p->cpu_count == 0) {
+    for (i = 0; i < CPU_SETSIZE; i++) {
+      CPU_SET(i, &set);
+    }
+  } else {
+    i = w->id % p->cpu_count;
+    CPU_SET(p->cpu_order[i], &set);
+    node = p->cpu_node[i];
+  }
+
+  if (pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0) {
+    printf("Warning: Thread pool could not pin worker %d\n", w->id);
+    node = -1;
+  }
+  __atomic_store_n(&w->node, node, __ATOMIC_RELAXED);
+}
+
+static void start_worker(Worker * w) {
+  if (pthread_create(&w->thread, NULL, worker, w) != 0) {
+    printf("ERROR: Thread pool could not create worker thread\n");
+    exit(1);
+  }
+  if (w->pool->affinity != POOL_AFFINITY_NONE) pin(w->pool, w);
+}
+
+/* Submits a task whose dependencies have completed to its pool */
+static void submit_ready(Task * t) {
+  Pool * p = t->owner != NULL ? t->owner : pool_default();
+
+  if (p == NULL) {
+    task_execute(t);
+  } else {
+    pool_submit_to(p, t);
+  }
+}
+
+static Pool * create(int threads, int steal) {
+  Pool * p;
+  int i;
 
-void pool_init(int threads){
-  int i, res;
-  
   if (threads <= 0) {
     printf("Warning: Thread pool initialized with non-positive number of worker threads\n");
-    return;
+    return NULL;
+  }
+  if (threads > MAX_WORKERS) {
+    printf("Warning: Thread pool limited to %d worker threads\n", MAX_WORKERS);
+    threads = MAX_WORKERS;
+  }
+
+  p = calloc(1, sizeof(Pool));
+  if (p == NULL) {
+    printf("ERROR: Thread pool could not be allocated\n");
+    exit(1);
+  }
+
+  p->task_queue = aq_create_prio(POOL_PRIO_LEVELS);
+
+  if (p->task_queue == NULL) {
+    printf("ERROR: Thread pool could not create alarm queue\n");
+    exit(1);
   }
- 
-  pthread_mutex_lock(&mutex);
-  if (workers > 0) {
-    pthread_mutex_unlock(&mutex);
+  aq_set_aging(p->task_queue, PRIO_AGING);
+  p->stealing = steal;
+  task_set_ready_hook(submit_ready);
+  task_set_help_hook(help);
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_mutex_init(&p->timer_mutex, NULL);
+
+  /* Node queues, only worth it with several nodes */
+  TopoCpu * cpus = malloc(sizeof(TopoCpu) * TOPO_MAX_CPUS);
+  if (cpus == NULL) {
+    printf("ERROR: Thread pool could not be allocated\n");
+    exit(1);
+  }
+  p->nodes = topo_nodes(cpus, topo_read(cpus, TOPO_MAX_CPUS));
+  free(cpus);
+  if (p->nodes > TOPO_MAX_NODES) p->nodes = TOPO_MAX_NODES;
+  if (p->nodes > 1) {
+    for (i = 0; i < p->nodes; i++) {
+      if ((p->node_queues[i] = aq_create()) == NULL) {
+        printf("ERROR: Thread pool could not create alarm queue\n");
+        exit(1);
+      }
+    }
+  }
+
+  /* All deques must exist before any worker starts stealing */
+  for (i = 0; i < threads; i++) {
+    p->worker_list[i] = new_worker(p, i);
+  }
+  p->workers = threads;
+  p->max_compensators = threads;
+
+  for (i = 0; i < threads; i++) {
+    start_worker(p->worker_list[i]);
+  }
+  return p;
+}
+
+Pool * pool_create(int threads) {
+  return create(threads, 0);
+}
+
+Pool * pool_create_stealing(int threads) {
+  return create(threads, 1);
+}
+
+static void init_default(int threads, int steal) {
+  pthread_mutex_lock(&default_mutex);
+  if (default_pool != NULL) {
+    pthread_mutex_unlock(&default_mutex);
     printf("Warning: Thread pool already initialized\n");
     return;
   }
-    
-  workers = threads;
 
-  task_queue = aq_create();
+  /* Publish the pool, submissions read it without the lock */
+  __atomic_store_n(&default_pool, create(threads, steal), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&default_mutex);
+}
 
-  if (task_queue == NULL) {
-    printf("ERROR: Thread pool could not create alarm queue\n");
+void pool_init(int threads){
+  init_default(threads, 0);
+}
+
+void pool_init_stealing(int threads){
+  init_default(threads, 1);
+}
+
+Pool * pool_default(void) {
+  return __atomic_load_n(&default_pool, __ATOMIC_ACQUIRE);
+}
+
+static void check_initialized(Pool * p) {
+  if (p == NULL) {
+    printf("ERROR: Task submitted to unitialized thread pool\n");
     exit(1);
   }
+}
+
+/* Wakes up to n idle workers in work-stealing mode, or compensating
+   workers waiting for a retire alarm to be taken otherwise */
+static void notify_idle(Pool * p, int n) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&p->idle_waiters, __ATOMIC_RELAXED) > 0) {
+    __atomic_fetch_add(&p->idle_epoch, 1, __ATOMIC_SEQ_CST);
+    park_wake(&p->idle_epoch, n);
+  }
+}
 
-  for (i = 0; i < workers; i++) {
-    pthread_t * new = malloc(sizeof(pthread_t));
-    res = pthread_create(new, NULL, worker, NULL);
-    if (res < 0) {
-     printf("ERROR: Thread pool could not create worker thread\n");
-     exit(1);
+static void blocking_begin(Worker * w);
+static void blocking_end(Worker * w);
+
+/* Runs t and wakes pool_drain if it was the last pending task */
+static void execute(Pool * p, Task * t) {
+  if (t->blocking) {
+    blocking_begin(self);
+    task_execute(t);
+    blocking_end(self);
+  } else {
+    task_execute(t);
+  }
+  if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&p->drain_waiters, __ATOMIC_SEQ_CST) > 0) {
+    park_wake(&p->pending, INT_MAX);
+  }
+}
+
+void pool_submit_to(Pool * p, Task * t) {
+  pool_submit_prio_to(p, t, POOL_PRIO_NORMAL);
+}
+
+void pool_submit_prio_to(Pool * p, Task * t, int prio) {
+  if (t == NULL) {
+    printf("ERROR: Task submitted to thread pool is NULL\n");
+    exit(1);
+  }
+
+  check_initialized(p);
+
+  if (prio < 0 || prio >= POOL_PRIO_LEVELS) {
+    printf("ERROR: Task submitted with invalid priority %d\n", prio);
+    exit(1);
+  }
+
+  __atomic_fetch_add(&p->pending, 1, __ATOMIC_RELAXED);
+  t->owner = p;
+
+  if (p->stealing && self != NULL && self->pool == p) {
+    /* Submitted by a worker: keep it local, others may steal it */
+    deque_push(&self->deque, t);
+  } else {
+    aq_send_prio(p->task_queue, t, prio);
+  }
+
+  if (p->stealing) notify_idle(p, 1);
+}
+
+void pool_submit_batch_to(Pool * p, Task ** ts, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (ts[i] == NULL) {
+      printf("ERROR: Task submitted to thread pool is NULL\n");
+      exit(1);
     }
   }
 
-  pthread_mutex_unlock(&mutex);
+  check_initialized(p);
+
+  __atomic_fetch_add(&p->pending, n, __ATOMIC_RELAXED);
+  for (i = 0; i < n; i++) {
+    ts[i]->owner = p;
+  }
+
+  if (p->stealing && self != NULL && self->pool == p) {
+    for (i = 0; i < n; i++) {
+      deque_push(&self->deque, ts[i]);
+    }
+  } else {
+    aq_send_batch(p->task_queue, (void **) ts, NULL, n);
+  }
+
+  if (p->stealing) notify_idle(p, n);
 }
 
-void pool_submit(Task * t) {
+void pool_submit_near_to(Pool * p, Task * t, int node) {
   if (t == NULL) {
     printf("ERROR: Task submitted to thread pool is NULL\n");
     exit(1);
   }
-  
-  pthread_mutex_lock(&mutex);
-  if (workers == 0) {
-    pthread_mutex_unlock(&mutex);
-    printf("ERROR: Task submitted to unitialized thread pool\n");
+
+  check_initialized(p);
+
+  if (p->nodes <= 1 || node < 0 || node >= p->nodes) {
+    pool_submit_prio_to(p, t, POOL_PRIO_NORMAL);
+    return;
+  }
+
+  __atomic_fetch_add(&p->pending, 1, __ATOMIC_RELAXED);
+  t->owner = p;
+
+  /* The task must be queued before its token can be received */
+  aq_send(p->node_queues[node], t, AQ_NORMAL);
+  aq_send_prio(p->task_queue, NEAR, POOL_PRIO_NORMAL);
+
+  if (p->stealing) notify_idle(p, 1);
+}
+
+/* Takes a task from the queue of the node of w, if it has one */
+static Task * take_local(Worker * w) {
+  Pool * p = w->pool;
+  int node = __atomic_load_n(&w->node, __ATOMIC_RELAXED);
+  void * msg;
+
+  if (p->nodes <= 1 || node < 0) return NULL;
+  return aq_try_recv(p->node_queues[node], &msg) >= 0 ? msg : NULL;
+}
+
+/*
+ * Takes a task for a near token: from the node of w if possible, otherwise
+ * from any node.  Every queued task has a token, but pinned workers also
+ * take tasks without one, so the tokens may outnumber the tasks and some
+ * find none.  A task pushed after its queue was looked at comes with a
+ * token of its own, so none is left behind.
+ */
+static Task * take_near(Worker * w) {
+  Pool * p = w->pool;
+  Task * t;
+  void * msg;
+  int i;
+
+  if ((t = take_local(w)) != NULL) return t;
+  for (i = 0; i < p->nodes; i++) {
+    if (aq_try_recv(p->node_queues[i], &msg) >= 0) return msg;
+  }
+  return NULL;
+}
+
+/*
+ * Takes a task for a steal token: from the deque of w if possible,
+ * otherwise from any worker's.  As with near tokens, some tokens find none.
+ */
+static Task * take_spawned(Worker * w) {
+  Pool * p = w->pool;
+  Task * t;
+  int i, n;
+
+  if ((t = deque_take(&w->deque)) != NULL) return t;
+  n = __atomic_load_n(&p->workers, __ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++) {
+    Worker * victim = p->worker_list[i];
+    while (deque_size(&victim->deque) > 0) {
+      if ((t = deque_steal(&victim->deque)) != NULL) return t;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Submits a subtask the running task is going to await.  In a worker it
+ * goes to the worker's own deque, also in non-stealing mode.  Awaiting it,
+ * the worker then takes its own subtasks back first, rather than nesting
+ * older queued work.  In non-stealing mode idle workers look in the deques
+ * before blocking on the queue, and a steal token wakes them if they are
+ * already blocked.  Busy workers need no token, so tokens only go out
+ * while some worker is idle; the queue may be bounded.
+ */
+static void spawn(Pool * p, Task * t) {
+  if (self == NULL || self->pool != p || self->compensating) {
+    pool_submit_to(p, t);
+    return;
+  }
+
+  __atomic_fetch_add(&p->pending, 1, __ATOMIC_RELAXED);
+  t->owner = p;
+  deque_push(&self->deque, t);
+
+  if (p->stealing) {
+    notify_idle(p, 1);
+  } else {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->idle_workers, __ATOMIC_RELAXED) > 0) {
+      aq_send(p->task_queue, STEAL, AQ_NORMAL);
+    }
+  }
+}
+
+void pool_submit(Task * t) {
+  pool_submit_prio_to(pool_default(), t, POOL_PRIO_NORMAL);
+}
+
+void pool_submit_prio(Task * t, int prio) {
+  pool_submit_prio_to(pool_default(), t, prio);
+}
+
+void pool_submit_batch(Task ** ts, int n) {
+  pool_submit_batch_to(pool_default(), ts, n);
+}
+
+void pool_submit_near(Task * t, int node) {
+  pool_submit_near_to(pool_default(), t, node);
+}
+
+int pool_threads(Pool * p) {
+  return p != NULL ? __atomic_load_n(&p->workers, __ATOMIC_RELAXED) : 0;
+}
+
+int pool_nodes(Pool * p) {
+  return p != NULL ? p->nodes : 1;
+}
+
+/*
+ * Parallel loops.  The range is cut into chunks of grain elements, and
+ * spans of chunks are split in halves recursively: the right half is
+ * submitted as a task, the left half run in place, and the right half then
+ * awaited, so the worker helps with other tasks meanwhile.  Results are
+ * combined on the way back, left before right.  Subtasks inherit the
+ * cancellation token of the task splitting them; cancelled chunks count as
+ * the identity.
+ */
+typedef struct {
+  Pool * pool;
+  long begin, end, grain, overlap;
+  long chunks;
+  void (*body)(long, long, void *);    // pool_parallel_for
+  long (*map)(long, long, void *);     // pool_parallel_reduce
+  long (*combine)(long, long, void *);
+  long identity;
+  void * ctx;
+} Loop;
+
+/* Chunks lo..hi-1 of a loop, run by a task */
+typedef struct {
+  Loop * loop;
+  long lo, hi;
+} Span;
+
+static long run_chunk(Loop * l, long i) {
+  long from = l->begin + i * l->grain;
+  long to = l->end - from > l->grain ? from + l->grain : l->end;
+
+  /* Windows starting in the chunk may reach overlap elements past it */
+  to = l->end - to > l->overlap ? to + l->overlap : l->end;
+  if (task_cancelled()) return l->identity;
+  if (l->map != NULL) return l->map(from, to, l->ctx);
+  l->body(from, to, l->ctx);
+  return l->identity;
+}
+
+static void * run_span(void * arg);
+
+static long split(Loop * l, long lo, long hi) {
+  Task * current = task_current();
+  Span right;
+
+  if (hi - lo == 1) return run_chunk(l, lo);
+
+  right.loop = l;
+  right.lo = lo + (hi - lo) / 2;
+  right.hi = hi;
+  Task * t = task_create_inline(&right, sizeof(Span), run_span);
+  if (current != NULL) task_set_cancel(t, current->cancel);
+  spawn(l->pool, t);
+
+  long left = split(l, lo, right.lo);
+  task_await(t);
+  long res = task_skipped(t) ? l->identity : (long) t->res;
+  task_dismiss(t);
+  return l->combine != NULL ? l->combine(left, res, l->ctx) : l->identity;
+}
+
+static void * run_span(void * arg) {
+  Span * s = arg;
+  return (void *) split(s->loop, s->lo, s->hi);
+}
+
+static long run_loop(Loop * l) {
+  Pool * p = l->pool;
+  long n = l->end - l->begin;
+
+  check_initialized(p);
+  if (n <= 0) return l->identity;
+  if (l->overlap < 0) l->overlap = 0;
+  if (l->grain <= 0) {
+    /* A few chunks per worker, to even out their loads */
+    long parts = 4L * __atomic_load_n(&p->workers, __ATOMIC_RELAXED);
+    l->grain = (n + parts - 1) / parts;
+  }
+  l->chunks = (n + l->grain - 1) / l->grain;
+
+  if (self != NULL && self->pool == p) return split(l, 0, l->chunks);
+
+  /* Outside the pool, leave all the work to its workers */
+  Span all = { l, 0, l->chunks };
+  Task * t = task_create_inline(&all, sizeof(Span), run_span);
+  Task * current = task_current();
+  if (current != NULL) task_set_cancel(t, current->cancel);
+  pool_submit_to(p, t);
+  task_await(t);
+  long res = task_skipped(t) ? l->identity : (long) t->res;
+  task_dismiss(t);
+  return res;
+}
+
+void pool_parallel_for_to(Pool * p, long begin, long end, long grain, long overlap,
+                          void (*body)(long from, long to, void * ctx), void * ctx) {
+  Loop l = { p, begin, end, grain, overlap, 0, body, NULL, NULL, 0, ctx };
+
+  if (body == NULL) {
+    printf("ERROR: Parallel loop without body\n");
+    exit(1);
+  }
+  run_loop(&l);
+}
+
+long pool_parallel_reduce_to(Pool * p, long begin, long end, long grain, long overlap,
+                             long (*map)(long from, long to, void * ctx),
+                             long (*combine)(long a, long b, void * ctx),
+                             long identity, void * ctx) {
+  Loop l = { p, begin, end, grain, overlap, 0, NULL, map, combine, identity, ctx };
+
+  if (map == NULL || combine == NULL) {
+    printf("ERROR: Parallel reduction without map or combine\n");
     exit(1);
   }
-    
-  aq_send(task_queue, t, AQ_NORMAL);
-  
-  pthread_mutex_unlock(&mutex);
+  return run_loop(&l);
 }
 
-  
+void pool_parallel_for(long begin, long end, long grain,
+                       void (*body)(long from, long to, void * ctx), void * ctx) {
+  pool_parallel_for_to(pool_default(), begin, end, grain, 0, body, ctx);
+}
+
+long pool_parallel_reduce(long begin, long end, long grain,
+                          long (*map)(long from, long to, void * ctx),
+                          long (*combine)(long a, long b, void * ctx),
+                          long identity, void * ctx) {
+  return pool_parallel_reduce_to(pool_default(), begin, end, grain, 0, map, combine,
+                                 identity, ctx);
+}
+
+void pool_set_affinity(Pool * p, int policy, const int * cpus, int n) {
+  TopoCpu * topo;
+  int i, j, count;
+
+  if (p == NULL) {
+    printf("Warning: Thread pool configured before being initialized\n");
+    return;
+  }
+  if (policy < POOL_AFFINITY_NONE || policy > POOL_AFFINITY_LIST ||
+      (policy == POOL_AFFINITY_LIST && (cpus == NULL || n <= 0))) {
+    printf("Warning: Thread pool given invalid affinity policy\n");
+    return;
+  }
+
+  topo = malloc(sizeof(TopoCpu) * TOPO_MAX_CPUS);
+  if (topo == NULL) {
+    printf("ERROR: Thread pool could not be allocated\n");
+    exit(1);
+  }
+  count = topo_read(topo, TOPO_MAX_CPUS);
+  if (policy == POOL_AFFINITY_COMPACT) topo_compact(topo, count);
+  if (policy == POOL_AFFINITY_SCATTER) topo_scatter(topo, count);
+
+  pthread_mutex_lock(&p->mutex);
+  if (policy == POOL_AFFINITY_LIST) {
+    /* Keep the given order, skipping CPUs that are not online */
+    p->cpu_count = 0;
+    for (i = 0; i < n && p->cpu_count < TOPO_MAX_CPUS; i++) {
+      for (j = 0; j < count && topo[j].cpu != cpus[i]; j++);
+      if (j == count) {
+        printf("Warning: Thread pool ignores CPU %d, which is not online\n", cpus[i]);
+        continue;
+      }
+      p->cpu_order[p->cpu_count] = topo[j].cpu;
+      p->cpu_node[p->cpu_count++] = topo[j].node;
+    }
+  } else {
+    for (i = 0; i < count; i++) {
+      p->cpu_order[i] = topo[i].cpu;
+      p->cpu_node[i] = topo[i].node;
+    }
+    p->cpu_count = count;
+  }
+  free(topo);
+
+  /* Without any CPU left, workers are unpinned */
+  int was_pinned = p->affinity != POOL_AFFINITY_NONE;
+  p->affinity = p->cpu_count > 0 ? policy : POOL_AFFINITY_NONE;
+  if (p->affinity != POOL_AFFINITY_NONE || was_pinned) {
+    for (i = 0; i < p->workers; i++) {
+      pin(p, p->worker_list[i]);
+    }
+  }
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void pool_drain(Pool * p) {
+  int n;
+
+  if (p == NULL) return;
+  if (self != NULL && self->pool == p) {
+    printf("ERROR: Thread pool drained from one of its own workers\n");
+    exit(1);
+  }
+
+  __atomic_fetch_add(&p->drain_waiters, 1, __ATOMIC_SEQ_CST);
+  while ((n = __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST)) > 0) {
+    park_wait(&p->pending, n, NULL);
+  }
+  __atomic_fetch_sub(&p->drain_waiters, 1, __ATOMIC_RELAXED);
+}
+
+
 void * worker (void * arg) {
-  Task * task;
+  void * msgs[WORKER_BATCH];
+  MsgKind kinds[WORKER_BATCH];
+  int i, n, max;
+
+  self = arg;
+  Worker * w = self;
+  Pool * p = w->pool;
+  if (p->stealing) return stealing_worker(w);
+
+  while (!w->retiring) {
+    Task * t;
+    if ((t = take_local(w)) != NULL) {
+      execute(p, t);
+      continue;
+    }
+
+    /* Pull tasks from task queue, taking no more than a fair share
+       of the backlog so other workers are not starved */
+    max = aq_size(p->task_queue) / __atomic_load_n(&p->workers, __ATOMIC_RELAXED);
+    if (max < 1) max = 1;
+    if (max > WORKER_BATCH) max = WORKER_BATCH;
 
-  while (1) {
-    /* Pull task from task queue */
-    int kind = aq_recv(task_queue,  (void **) &task);
-    if (kind == AQ_NORMAL) {
-      /* Normal messages are assumed to be Tasks to be executed */
-      task_execute(task);
+    /* Announce ourselves before looking for subtasks spawned without a
+       token, see spawn */
+    __atomic_fetch_add(&p->idle_workers, 1, __ATOMIC_SEQ_CST);
+    t = take_spawned(w);
+    n = t == NULL ? aq_recv_batch(p->task_queue, msgs, max, kinds) : 0;
+    __atomic_fetch_sub(&p->idle_workers, 1, __ATOMIC_RELAXED);
+    if (t != NULL) {
+      execute(p, t);
+      continue;
+    }
+
+    w->batch_next = w->batch_n = 0;
+    for (i = 0; i < n; i++) {
+      if (kinds[i] == AQ_NORMAL && msgs[i] == NEAR) {
+        if ((t = take_near(w)) != NULL) w->batch[w->batch_n++] = t;
+      } else if (kinds[i] == AQ_NORMAL && msgs[i] == STEAL) {
+        if ((t = take_spawned(w)) != NULL) w->batch[w->batch_n++] = t;
+      } else if (kinds[i] == AQ_NORMAL) {
+        /* Normal messages are assumed to be Tasks to be executed */
+        w->batch[w->batch_n++] = msgs[i];
+      } else if (msgs[i] == RETIRE) {
+        /* Finish the tasks already pulled, then retire */
+        w->retiring++;
+        notify_idle(p, INT_MAX);     // Compensating workers wait for this, see pass_retire
+      }
+    }
+
+    /* Tasks awaiting others may run the rest of the batch, see help */
+    while (w->batch_next < w->batch_n) {
+      execute(p, w->batch[w->batch_next++]);
+    }
+  }
+
+  retire(w);
+  return NULL;
+}
+
+/* xorshift, for picking victims */
+static unsigned int next_random(unsigned int * state) {
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/*
+ * Finds a task for w: from its own deque, from a random victim or
+ * from the injection queue, in that order.
+ */
+static Task * find_task(Worker * w, unsigned int * seed) {
+  Pool * p = w->pool;
+  Task * t;
+  void * msg;
+  int i, n, start, kind;
+
+  /* Retire requests go first (we may get a task instead if we lose the race),
+     compensating workers leave them to the others */
+  if (!w->compensating && aq_alarms(p->task_queue) > 0 && (kind = aq_try_recv(p->task_queue, &msg)) >= 0) {
+    if (msg == NEAR) msg = take_near(w);
+    if (msg != NULL && (kind == AQ_NORMAL || msg == RETIRE)) return msg;
+  }
+
+  if ((t = deque_take(&w->deque)) != NULL) return t;
+  if ((t = take_local(w)) != NULL) return t;
+
+  n = __atomic_load_n(&p->workers, __ATOMIC_ACQUIRE);
+  start = next_random(seed) % n;
+  for (i = 0; i < n; i++) {
+    Worker * victim = p->worker_list[(start + i) % n];
+    if (victim == w) continue;
+    /* A failed steal may have lost a race, retry while items remain */
+    while (deque_size(&victim->deque) > 0) {
+      if ((t = deque_steal(&victim->deque)) != NULL) return t;
+    }
+  }
+
+  while ((kind = aq_try_recv(p->task_queue, &msg)) >= 0) {
+    /* Normal messages are assumed to be Tasks, alarms ask us to retire */
+    if (msg == NEAR) msg = take_near(w);
+    if (msg != NULL && (kind == AQ_NORMAL || msg == RETIRE)) return msg;
+  }
+  return NULL;
+}
+
+static void * stealing_worker(Worker * w) {
+  Pool * p = w->pool;
+  Task * t;
+
+  while (!w->retiring) {
+    if ((t = find_task(w, &w->seed)) == NULL) {
+      /* Announce ourselves before the final check, then park */
+      __atomic_fetch_add(&p->idle_workers, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&p->idle_waiters, 1, __ATOMIC_SEQ_CST);
+      int epoch = __atomic_load_n(&p->idle_epoch, __ATOMIC_SEQ_CST);
+      t = find_task(w, &w->seed);
+      if (t == NULL) park_wait(&p->idle_epoch, epoch, NULL);
+      __atomic_fetch_sub(&p->idle_waiters, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_sub(&p->idle_workers, 1, __ATOMIC_RELAXED);
+      if (t == NULL) continue;
+    }
+    if ((void *) t == RETIRE) {
+      w->retiring++;
     } else {
-      /* Alarm messages are assumed not to be used */
+      execute(p, t);
     }
   }
 
+  /* Hand our own tasks back to the others */
+  int n = 0;
+  while ((t = deque_take(&w->deque)) != NULL) {
+    aq_send(p->task_queue, t, AQ_NORMAL);
+    n++;
+  }
+  if (n > 0) notify_idle(p, n);
+
+  retire(w);
   return NULL;
 }
 
+/*
+ * Help hook of task_await: runs one other task for a worker awaiting a task.
+ * A worker only takes tasks it could also have run from its main loop, so
+ * every task not yet started is either queued, stealable, or in the batch
+ * of a worker that is bound to run it.  Retire alarms received while
+ * helping are deferred until the worker is back in its loop.
+ */
+static int help(void) {
+  Worker * w = self;
+  Task * t = NULL;
+  void * msg;
+  int kind;
+
+  if (w == NULL) return -1;
+  Pool * p = w->pool;
+
+  if (p->stealing) {
+    while ((t = find_task(w, &w->seed)) == RETIRE) {
+      w->retiring++;
+    }
+  } else if ((t = deque_take(&w->deque)) != NULL) {
+    /* Own subtasks first, they are likely what we await */
+  } else if (w->batch_next < w->batch_n) {
+    t = w->batch[w->batch_next++];
+  } else if ((t = take_local(w)) == NULL) {
+    while ((kind = aq_try_recv(p->task_queue, &msg)) >= 0) {
+      if (kind == AQ_NORMAL && msg == NEAR) {
+        if ((t = take_near(w)) != NULL) break;
+      } else if (kind == AQ_NORMAL && msg == STEAL) {
+        if ((t = take_spawned(w)) != NULL) break;
+      } else if (kind == AQ_NORMAL) {
+        t = msg;
+        break;
+      }
+      if (msg == RETIRE) {
+        w->retiring++;
+        notify_idle(p, INT_MAX);
+      }
+    }
+  }
+
+  if (t == NULL) return 0;
+  execute(p, t);
+  return 1;
+}
+
+/*
+ * Compensation.  A worker about to block hands back the rest of its batch
+ * and raises the number of compensating
+ * workers wanted to the number of blocked workers, up to max_compensators,
+ * and starts a new compensating worker for each one it adds.  These run
+ * tasks like other workers, but are not in the worker list, and pass retire
+ * alarms on.  Each exits on its own once more compensating workers are
+ * wanted than there are blocked workers.
+ */
+static void * compensator(void * arg);
+
+static void blocking_begin(Worker * w) {
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if (w == NULL) return;
+  Pool * p = w->pool;
+
+  /* The rest of our batch would wait for us, hand it back */
+  if (w->batch_next < w->batch_n) {
+    aq_send_batch(p->task_queue, (void **) &w->batch[w->batch_next], NULL,
+                  w->batch_n - w->batch_next);
+    w->batch_n = w->batch_next;
+  }
+
+  int blocked = __atomic_add_fetch(&p->blocked, 1, __ATOMIC_SEQ_CST);
+  int c = __atomic_load_n(&p->compensators, __ATOMIC_SEQ_CST);
+
+  while (c < blocked && c < p->max_compensators) {
+    if (!__atomic_compare_exchange_n(&p->compensators, &c, c + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      continue;
+    }
+    Worker * cw = malloc(sizeof(Worker));
+    if (cw == NULL) {
+      printf("ERROR: Thread pool could not allocate worker\n");
+      exit(1);
+    }
+    deque_init(&cw->deque);
+    cw->id = -1;
+    cw->retiring = 0;
+    cw->retired = 0;
+    cw->compensating = 1;
+    cw->node = -1;
+    cw->batch_next = cw->batch_n = 0;
+    cw->seed = 2463534242u ^ (unsigned int) blocked * 7919u;
+    cw->pool = p;
+    cw->next = NULL;
+
+    __atomic_fetch_add(&p->compensator_threads, 1, __ATOMIC_SEQ_CST);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, compensator, cw) != 0) {
+      printf("ERROR: Thread pool could not create worker thread\n");
+      exit(1);
+    }
+    pthread_attr_destroy(&attr);
+    break;
+  }
+}
+
+static void blocking_end(Worker * w) {
+  if (w == NULL) return;
+  __atomic_sub_fetch(&w->pool->blocked, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Tells a compensating worker whether it is still wanted, if not it exits */
+static int still_needed(Pool * p) {
+  int c = __atomic_load_n(&p->compensators, __ATOMIC_SEQ_CST);
+
+  while (c > __atomic_load_n(&p->blocked, __ATOMIC_SEQ_CST)) {
+    if (__atomic_compare_exchange_n(&p->compensators, &c, c - 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Passes retire alarms received by a compensating worker on.  Without
+ * work stealing, it then parks on the idle event until a regular worker
+ * takes the alarm, rather than receive it again at once.
+ */
+static void pass_retire(Worker * w) {
+  Pool * p = w->pool;
+  struct timespec deadline;
+
+  if (w->retiring == 0) return;
+  for (; w->retiring > 0; w->retiring--) {
+    aq_send(p->task_queue, RETIRE, AQ_ALARM);
+    if (p->stealing) notify_idle(p, INT_MAX);
+  }
+  if (p->stealing) return;
+
+  park_deadline(&deadline, COMPENSATE_POLL_US);
+  __atomic_fetch_add(&p->idle_waiters, 1, __ATOMIC_SEQ_CST);
+  int epoch = __atomic_load_n(&p->idle_epoch, __ATOMIC_SEQ_CST);
+  if (aq_alarms(p->task_queue) > 0) park_wait(&p->idle_epoch, epoch, &deadline);
+  __atomic_fetch_sub(&p->idle_waiters, 1, __ATOMIC_RELAXED);
+}
+
+static void * compensator(void * arg) {
+  Worker * w = arg;
+  Pool * p = w->pool;
+  struct timespec deadline;
+  Task * t;
+  void * msg;
+  int kind;
+
+  self = w;
+  while (still_needed(p)) {
+    t = NULL;
+    if (p->stealing) {
+      if ((t = find_task(w, &w->seed)) == NULL) {
+        park_deadline(&deadline, COMPENSATE_POLL_US);
+        __atomic_fetch_add(&p->idle_waiters, 1, __ATOMIC_SEQ_CST);
+        int epoch = __atomic_load_n(&p->idle_epoch, __ATOMIC_SEQ_CST);
+        t = find_task(w, &w->seed);
+        if (t == NULL) park_wait(&p->idle_epoch, epoch, &deadline);
+        __atomic_fetch_sub(&p->idle_waiters, 1, __ATOMIC_RELAXED);
+      }
+    } else if ((kind = aq_recv_timeout(p->task_queue, &msg, COMPENSATE_POLL_US)) >= 0) {
+      t = msg == NEAR ? take_near(w) : msg == STEAL ? take_spawned(w) : msg;
+    }
+
+    if ((void *) t == RETIRE) {
+      w->retiring++;
+    } else if (t != NULL) {
+      execute(p, t);
+    }
+    pass_retire(w);
+  }
+
+  /* Hand our own tasks back to the others */
+  int n = 0;
+  while ((t = deque_take(&w->deque)) != NULL) {
+    aq_send(p->task_queue, t, AQ_NORMAL);
+    n++;
+  }
+  if (n > 0) notify_idle(p, n);
+
+  deque_destroy(&w->deque);
+  free(w);
+
+  /* p may be destroyed as soon as the count drops to zero */
+  if (__atomic_sub_fetch(&p->compensator_threads, 1, __ATOMIC_SEQ_CST) == 0) {
+    park_wake(&p->compensator_threads, INT_MAX);
+  }
+  return NULL;
+}
+
+void pool_blocking_begin(void) {
+  blocking_begin(self);
+}
+
+void pool_blocking_end(void) {
+  blocking_end(self);
+}
+
+void pool_set_blocking_max(Pool * p, int max) {
+  if (p == NULL) {
+    printf("Warning: Thread pool configured before being initialized\n");
+    return;
+  }
+  __atomic_store_n(&p->max_compensators, max > 0 ? max : 0, __ATOMIC_RELAXED);
+}
+
+void pool_submit_blocking_to(Pool * p, Task * t) {
+  if (t == NULL) {
+    printf("ERROR: Task submitted to thread pool is NULL\n");
+    exit(1);
+  }
+  t->blocking = 1;
+  pool_submit_prio_to(p, t, POOL_PRIO_NORMAL);
+}
+
+void pool_submit_blocking(Task * t) {
+  pool_submit_blocking_to(pool_default(), t);
+}
+
+/*
+ * Timers.  Delayed and periodic submissions are kept in a timing wheel
+ * with one tick per TIMER_TICK_US.  The timer thread advances the wheel to
+ * the current tick and submits the tasks due, then sleeps until the wheel
+ * next needs advancing, or a timer is added.  Tasks are submitted with the
+ * timer mutex held, so a cancelled timer never submits its task.
+ */
+static unsigned long current_tick(Pool * p) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - p->timer_start.tv_sec) * 1000000L +
+          (now.tv_nsec - p->timer_start.tv_nsec) / 1000) / TIMER_TICK_US;
+}
+
+static void tick_time(Pool * p, unsigned long tick, struct timespec * ts) {
+  long us = tick * TIMER_TICK_US;
+
+  ts->tv_sec = p->timer_start.tv_sec + us / 1000000;
+  ts->tv_nsec = p->timer_start.tv_nsec + (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/* Called by wheel_advance with the timer mutex held */
+static void timer_expired(WheelNode * n, void * arg) {
+  Pool * p = arg;
+  Timer * tm = (Timer *) n;
+  Task * t = tm->task;
+
+  if (tm->period == 0) {
+    t->timer = NULL;
+    free(tm);
+    pool_submit_to(p, t);
+    return;
+  }
+
+  wheel_add(&p->wheel, n, n->expires + tm->period);
+  if (!tm->submitted) {
+    tm->submitted = 1;
+    pool_submit_to(p, t);
+  } else if (task_completed(t)) {
+    /* A period is skipped if the task is still queued or running */
+    task_reset(t);
+    pool_submit_to(p, t);
+  }
+}
+
+static void * timer_loop(void * arg) {
+  Pool * p = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&p->timer_mutex);
+  while (p->timing) {
+    wheel_advance(&p->wheel, current_tick(p), timer_expired, p);
+
+    long ticks = wheel_next(&p->wheel);
+    if (ticks < 0) {
+      pthread_cond_wait(&p->timer_changed, &p->timer_mutex);
+    } else {
+      tick_time(p, p->wheel.now + ticks, &deadline);
+      pthread_cond_timedwait(&p->timer_changed, &p->timer_mutex, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&p->timer_mutex);
+  return NULL;
+}
+
+/* Arms a timer for t, starting the timer thread if needed */
+static void add_timer(Pool * p, Task * t, long delay_us, long period_us) {
+  Timer * tm;
+
+  if (t == NULL) {
+    printf("ERROR: Task submitted to thread pool is NULL\n");
+    exit(1);
+  }
+  check_initialized(p);
+
+  tm = malloc(sizeof(Timer));
+  if (tm == NULL) {
+    printf("ERROR: Thread pool could not allocate timer\n");
+    exit(1);
+  }
+  tm->task = t;
+  tm->period = period_us > 0 ? (period_us + TIMER_TICK_US - 1) / TIMER_TICK_US : 0;
+  tm->submitted = 0;
+  if (delay_us < 0) delay_us = 0;
+
+  pthread_mutex_lock(&p->timer_mutex);
+  if (!p->timing) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->timer_changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    clock_gettime(CLOCK_MONOTONIC, &p->timer_start);
+    wheel_init(&p->wheel, 0);
+    p->timing = 1;
+    if (pthread_create(&p->timer_thread, NULL, timer_loop, p) != 0) {
+      printf("ERROR: Thread pool could not create timer thread\n");
+      exit(1);
+    }
+  }
+  t->owner = p;
+  t->timer = tm;
+  wheel_add(&p->wheel, &tm->node,
+            current_tick(p) + (delay_us + TIMER_TICK_US - 1) / TIMER_TICK_US);
+  pthread_cond_signal(&p->timer_changed);
+  pthread_mutex_unlock(&p->timer_mutex);
+}
+
+void pool_submit_after_to(Pool * p, Task * t, long delay_us) {
+  add_timer(p, t, delay_us, 0);
+}
+
+void pool_submit_every_to(Pool * p, Task * t, long period_us) {
+  if (period_us <= 0) {
+    printf("ERROR: Task submitted with non-positive period\n");
+    exit(1);
+  }
+  add_timer(p, t, period_us, period_us);
+}
+
+void pool_submit_after(Task * t, long delay_us) {
+  pool_submit_after_to(pool_default(), t, delay_us);
+}
+
+void pool_submit_every(Task * t, long period_us) {
+  pool_submit_every_to(pool_default(), t, period_us);
+}
+
+int pool_cancel_timer(Task * t) {
+  Pool * p = t->owner;
+  Timer * tm;
+
+  if (p == NULL) return 0;
+  pthread_mutex_lock(&p->timer_mutex);
+  if ((tm = t->timer) != NULL) {
+    wheel_remove(&p->wheel, &tm->node);
+    t->timer = NULL;
+    free(tm);
+  }
+  pthread_mutex_unlock(&p->timer_mutex);
+  return tm != NULL;
+}
+
+/* Stops the timer thread, dropping the timers still pending */
+static void stop_timers(Pool * p) {
+  int l, s;
+
+  pthread_mutex_lock(&p->timer_mutex);
+  int running = p->timing;
+  p->timing = 0;
+  if (running) pthread_cond_signal(&p->timer_changed);
+  pthread_mutex_unlock(&p->timer_mutex);
+  if (!running) return;
+
+  pthread_join(p->timer_thread, NULL);
+  for (l = 0; l < WHEEL_LEVELS; l++) {
+    for (s = 0; s < WHEEL_SLOTS; s++) {
+      WheelNode * head = &p->wheel.slots[l][s];
+      while (head->next != head) {
+        Timer * tm = (Timer *) head->next;
+        wheel_remove(&p->wheel, &tm->node);
+        tm->task->timer = NULL;
+        free(tm);
+      }
+    }
+  }
+  pthread_cond_destroy(&p->timer_changed);
+}
+
+/* Tells adjust that w is about to exit */
+static void retire(Worker * w) {
+  Pool * p = w->pool;
+
+  /* Further alarms received while helping were meant for other workers */
+  while (--w->retiring > 0) {
+    aq_send(p->task_queue, RETIRE, AQ_ALARM);
+    if (p->stealing) notify_idle(p, INT_MAX);
+  }
+
+  __atomic_store_n(&w->retired, 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&p->retired_count, 1, __ATOMIC_SEQ_CST);
+  park_wake(&p->retired_count, INT_MAX);
+}
+
+/* Grows or shrinks the pool.  Called with the mutex held. */
+static void adjust(Pool * p, int threads) {
+  int i, n = p->workers;
+
+  if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+
+  if (threads > n) {
+    for (i = n; i < threads; i++) {
+      p->worker_list[i] = new_worker(p, i);
+    }
+    __atomic_store_n(&p->workers, threads, __ATOMIC_RELEASE);
+    for (i = n; i < threads; i++) {
+      start_worker(p->worker_list[i]);
+    }
+    return;
+  }
+
+  /* Ask n - threads workers, whichever get the alarms, to retire */
+  int target = __atomic_load_n(&p->retired_count, __ATOMIC_SEQ_CST) + (n - threads);
+  for (i = threads; i < n; i++) {
+    aq_send(p->task_queue, RETIRE, AQ_ALARM);
+    if (p->stealing) notify_idle(p, INT_MAX);
+  }
+  int seen;
+  while ((seen = __atomic_load_n(&p->retired_count, __ATOMIC_SEQ_CST)) < target) {
+    park_wait(&p->retired_count, seen, NULL);
+  }
+
+  /* Join the retired workers and fill their slots from the end */
+  i = 0;
+  while (i < n) {
+    Worker * w = p->worker_list[i];
+    if (!__atomic_load_n(&w->retired, __ATOMIC_ACQUIRE)) {
+      i++;
+      continue;
+    }
+    pthread_join(w->thread, NULL);
+    w->next = p->spare_workers;
+    p->spare_workers = w;
+    n--;
+    p->worker_list[i] = p->worker_list[n];
+    p->worker_list[i]->id = i;
+    __atomic_store_n(&p->workers, n, __ATOMIC_RELEASE);
+  }
+
+  /* Moved workers now have the CPUs of their new ids */
+  if (p->affinity != POOL_AFFINITY_NONE) {
+    for (i = 0; i < n; i++) {
+      pin(p, p->worker_list[i]);
+    }
+  }
+}
+
+void pool_resize(Pool * p, int threads) {
+  if (threads <= 0) {
+    printf("Warning: Thread pool cannot be adjusted to non-positive number of worker threads\n");
+    return;
+  }
+  if (p == NULL) {
+    printf("Warning: Thread pool adjusted before being initialized\n");
+    return;
+  }
+
+  pthread_mutex_lock(&p->mutex);
+  adjust(p, threads);
+  pthread_mutex_unlock(&p->mutex);
+}
 
 void pool_adjust(int threads) {
+  pool_resize(pool_default(), threads);
+}
+
+/*
+ * Autoscaler.  Grows the pool right away while tasks queue up and no worker
+ * is idle, and shrinks it gradually once workers have been idle with an
+ * empty queue for a while.  Stays within scale_min and scale_max.
+ */
+static void * autoscale(void * arg) {
+  Pool * p = arg;
+  int idle_samples = 0;
+
+  while (__atomic_load_n(&p->scaling, __ATOMIC_ACQUIRE)) {
+    usleep(AUTOSCALE_PERIOD_US);
+
+    pthread_mutex_lock(&p->mutex);
+    int i, n = p->workers;
+    long depth = aq_size(p->task_queue);
+    for (i = 0; i < n; i++) {
+      depth += deque_size(&p->worker_list[i]->deque);
+    }
+    int idle = __atomic_load_n(&p->idle_workers, __ATOMIC_RELAXED);
 
+    if (depth > 0 && idle == 0 && n < p->scale_max) {
+      adjust(p, n + depth < p->scale_max ? n + depth : p->scale_max);
+      idle_samples = 0;
+    } else if (depth == 0 && idle > 0 && n > p->scale_min) {
+      /* Retire half of the idle workers at a time */
+      if (++idle_samples >= AUTOSCALE_IDLE_SAMPLES) {
+        int retire = idle > 1 ? idle / 2 : 1;
+        adjust(p, n - retire > p->scale_min ? n - retire : p->scale_min);
+        idle_samples = 0;
+      }
+    } else {
+      idle_samples = 0;
+    }
+    pthread_mutex_unlock(&p->mutex);
+  }
+
+  return NULL;
+}
+
+void pool_set_autoscale(Pool * p, int min, int max) {
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (p == NULL) {
+    printf("Warning: Thread pool autoscaled before being initialized\n");
+    return;
+  }
+
+  pthread_mutex_lock(&p->mutex);
+  int running = p->scaling;
+  __atomic_store_n(&p->scaling, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&p->mutex);
+
+  /* Stop a running autoscaler before (re)configuring it */
+  if (running) pthread_join(p->scaler, NULL);
+  if (min <= 0) return;
+
+  if (max <= 0) max = cpus > 0 ? cpus : 1;
+  if (max > MAX_WORKERS) max = MAX_WORKERS;
+  if (max < min) max = min;
+
+  pthread_mutex_lock(&p->mutex);
+  p->scale_min = min;
+  p->scale_max = max;
+  if (p->workers < min) adjust(p, min);
+  if (p->workers > max) adjust(p, max);
+  __atomic_store_n(&p->scaling, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&p->scaler, NULL, autoscale, p) != 0) {
+    printf("ERROR: Thread pool could not create autoscaler thread\n");
+    exit(1);
+  }
+  pthread_mutex_unlock(&p->mutex);
 }
 
+void pool_autoscale(int min, int max) {
+  pool_set_autoscale(pool_default(), min, max);
+}
+
+void pool_destroy(Pool * p) {
+  Worker * w;
+
+  if (p == NULL) return;
+  if (self != NULL && self->pool == p) {
+    printf("ERROR: Thread pool destroyed from one of its own workers\n");
+    exit(1);
+  }
+
+  /* The default pool is forgotten first, so pool_init can create it anew */
+  Pool * expected = p;
+  __atomic_compare_exchange_n(&default_pool, &expected, NULL, 0,
+                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+  pool_set_autoscale(p, 0, 0);
+  stop_timers(p);
+  pool_drain(p);
+
+  /* With nothing blocked, compensating workers exit by themselves */
+  int n;
+  while ((n = __atomic_load_n(&p->compensator_threads, __ATOMIC_SEQ_CST)) > 0) {
+    park_wait(&p->compensator_threads, n, NULL);
+  }
+
+  pthread_mutex_lock(&p->mutex);
+  adjust(p, 0);
+  pthread_mutex_unlock(&p->mutex);
+
+  /* No worker is left that could steal from a spare */
+  while ((w = p->spare_workers) != NULL) {
+    p->spare_workers = w->next;
+    deque_destroy(&w->deque);
+    free(w);
+  }
+  aq_destroy(p->task_queue);
+  for (n = 0; n < p->nodes && p->nodes > 1; n++) {
+    aq_destroy(p->node_queues[n]);
+  }
+  pthread_mutex_destroy(&p->timer_mutex);
+  pthread_mutex_destroy(&p->mutex);
+  free(p);
+}
@@ -10,6 +10,19 @@
 
 #include "task.h"
 
+/* Priorities of submitted tasks */
+#define POOL_PRIO_HIGH     0   // Latency critical tasks
+#define POOL_PRIO_NORMAL   1   // Used by pool_submit
+#define POOL_PRIO_LOW      2   // Bulk work
+#define POOL_PRIO_LEVELS   3
+
+typedef struct Pool Pool;  // Opaque type
+
+/* Placement of workers on CPUs, see pool_set_affinity */
+#define POOL_AFFINITY_NONE     0   // Workers may run on any CPU
+#define POOL_AFFINITY_COMPACT  1   // Fill hyperthreads, cores, then packages
+#define POOL_AFFINITY_SCATTER  2   // Spread over packages and cores first
+#define POOL_AFFINITY_LIST     3   // CPUs given by the caller
 
 /**
  * @name    pool_init
@@ -17,6 +30,15 @@
  */
 void pool_init(int threads);
 
+/**
+ * @name    pool_init_stealing
+ * @brief   Initializes the thread pool with a number of worker threads in
+ *          work-stealing mode: each worker owns a deque of tasks, tasks
+ *          submitted from inside a worker go to that deque (ignoring their
+ *          priority), and idle workers steal from random other workers.
+ */
+void pool_init_stealing(int threads);
+
 /**
  * @name    pool_submit
  * @brief   Submits a created task for execution on the pool.
@@ -24,14 +46,280 @@ void pool_init(int threads);
  */
 void pool_submit(Task * t);
 
+/**
+ * @name    pool_submit_prio
+ * @brief   Submits a created task for execution on the pool with priority
+ *          prio (POOL_PRIO_HIGH .. POOL_PRIO_LOW).  Queued tasks of higher
+ *          priority are started first, but lower ones are not starved.
+ *          The pool must have been initialized before any submissions are made.
+ */
+void pool_submit_prio(Task * t, int prio);
+
+/**
+ * @name    pool_submit_batch
+ * @brief   Submits n created tasks for execution on the pool in one operation.
+ *          The pool must have been initialized before any submissions are made.
+ */
+void pool_submit_batch(Task ** ts, int n);
+
 /**
  * @name    pool_adjust
  * @brief   Changes the number of worker threads dynamically
  *          The pool must have been initialized
- *          Only to be implemented in Task 3.
+ *          Growing starts new workers.  Shrinking sends retire alarms over
+ *          the task queue and returns once the retired workers have been
+ *          joined; tasks they had already taken are completed first.
  */
 void pool_adjust(int threads);
 
+/**
+ * @name    pool_autoscale
+ * @brief   Starts an autoscaler that keeps adjusting the number of worker
+ *          threads between min and max from the queue depth and the number
+ *          of idle workers.  A non-positive max means the number of online
+ *          CPUs.  A non-positive min stops the autoscaler.
+ *          The pool must have been initialized
+ */
+void pool_autoscale(int min, int max);
+
+/**
+ * @name    pool_blocking_begin
+ * @brief   Tells the pool of the calling worker that it is about to block,
+ *          for instance in I/O.  The pool then starts a compensating worker,
+ *          unless as many are running as workers are blocked, or the maximum
+ *          set by pool_set_blocking_max has been reached.  Compensating
+ *          workers exit by themselves when no longer needed.
+ *          Does nothing outside pool workers.
+ */
+void pool_blocking_begin(void);
+
+/**
+ * @name    pool_blocking_end
+ * @brief   Tells the pool of the calling worker that it no longer blocks.
+ *          Must match an earlier pool_blocking_begin.
+ */
+void pool_blocking_end(void);
+
+/**
+ * @name    pool_submit_blocking
+ * @brief   Submits a created task that is expected to block.  The worker
+ *          running it is compensated as if the task were wrapped in
+ *          pool_blocking_begin/pool_blocking_end.
+ */
+void pool_submit_blocking(Task * t);
+
+/**
+ * @name    pool_submit_after
+ * @brief   Submits a created task for execution on the pool once delay_us
+ *          microseconds have passed (at a resolution of a millisecond).
+ *          The delay is kept in a timing wheel serviced by a timer thread,
+ *          so no worker is occupied meanwhile.
+ */
+void pool_submit_after(Task * t, long delay_us);
+
+/**
+ * @name    pool_submit_every
+ * @brief   Submits a created task for execution on the pool every period_us
+ *          microseconds, the first time after one period, until the timer is
+ *          cancelled.  The task is reset before each new submission; a period
+ *          is skipped if the previous submission has not yet completed.
+ *          The task must not be awaited before its timer is cancelled.
+ */
+void pool_submit_every(Task * t, long period_us);
+
+/**
+ * @name    pool_cancel_timer
+ * @brief   Cancels the pending delayed or periodic submission of task t.
+ *          A periodic task may still have a submission in progress, which
+ *          must be awaited before the task is dismissed.
+ * @retval  1 if a pending submission was cancelled, otherwise 0 (a delayed
+ *          task has already been submitted)
+ */
+int pool_cancel_timer(Task * t);
+
+/**
+ * @name    pool_create
+ * @brief   Creates a thread pool instance with a number of worker threads,
+ *          independent of the default pool and of other instances
+ * @retval  Handle to the pool if created, otherwise NULL
+ */
+Pool * pool_create(int threads);
+
+/**
+ * @name    pool_create_stealing
+ * @brief   As pool_create, but the pool runs in work-stealing mode
+ *          (see pool_init_stealing)
+ * @retval  Handle to the pool if created, otherwise NULL
+ */
+Pool * pool_create_stealing(int threads);
+
+/**
+ * @name    pool_default
+ * @brief   Gives the default pool used by pool_submit and friends
+ * @retval  Handle to the default pool, or NULL if not yet initialized
+ */
+Pool * pool_default(void);
+
+/**
+ * @name    pool_submit_to
+ * @brief   Submits a created task for execution on pool p
+ */
+void pool_submit_to(Pool * p, Task * t);
+
+/**
+ * @name    pool_submit_prio_to
+ * @brief   Submits a created task for execution on pool p with priority prio
+ */
+void pool_submit_prio_to(Pool * p, Task * t, int prio);
+
+/**
+ * @name    pool_submit_batch_to
+ * @brief   Submits n created tasks for execution on pool p in one operation
+ */
+void pool_submit_batch_to(Pool * p, Task ** ts, int n);
+
+/**
+ * @name    pool_submit_blocking_to
+ * @brief   Submits a created task expected to block for execution on pool p
+ */
+void pool_submit_blocking_to(Pool * p, Task * t);
+
+/**
+ * @name    pool_submit_after_to
+ * @brief   Submits a created task for execution on pool p after delay_us
+ *          microseconds (see pool_submit_after)
+ */
+void pool_submit_after_to(Pool * p, Task * t, long delay_us);
+
+/**
+ * @name    pool_submit_every_to
+ * @brief   Submits a created task for execution on pool p every period_us
+ *          microseconds (see pool_submit_every)
+ */
+void pool_submit_every_to(Pool * p, Task * t, long period_us);
+
+/**
+ * @name    pool_set_blocking_max
+ * @brief   Sets the maximum number of compensating workers of pool p.
+ *          Defaults to the initial number of worker threads, 0 disables
+ *          compensation.
+ */
+void pool_set_blocking_max(Pool * p, int max);
+
+/**
+ * @name    pool_resize
+ * @brief   Changes the number of worker threads of pool p (see pool_adjust)
+ */
+void pool_resize(Pool * p, int threads);
+
+/**
+ * @name    pool_set_autoscale
+ * @brief   Starts or stops the autoscaler of pool p (see pool_autoscale)
+ */
+void pool_set_autoscale(Pool * p, int min, int max);
+
+/**
+ * @name    pool_set_affinity
+ * @brief   Pins the workers of pool p, present and future, to CPUs in the
+ *          order given by policy: worker i runs on the i-th CPU of the
+ *          order, wrapping around.  The order is read from the sysfs
+ *          topology; with POOL_AFFINITY_LIST it is the n CPUs in cpus[].
+ *          POOL_AFFINITY_NONE unpins the workers.  Compensating workers are
+ *          never pinned.
+ */
+void pool_set_affinity(Pool * p, int policy, const int * cpus, int n);
+
+/**
+ * @name    pool_threads
+ * @brief   Gives the number of worker threads of pool p, not counting
+ *          compensating workers
+ */
+int pool_threads(Pool * p);
+
+/**
+ * @name    pool_nodes
+ * @brief   Gives the number of NUMA nodes pool p has a queue for
+ * @retval  Number of nodes, 1 on machines without several nodes
+ */
+int pool_nodes(Pool * p);
+
+/**
+ * @name    pool_submit_near_to
+ * @brief   Submits a created task for execution on pool p near NUMA node
+ *          node, for instance the node holding the data it works on.  A
+ *          worker pinned to that node runs it if one is free, otherwise any
+ *          worker does.  Without several nodes, or with an invalid node,
+ *          this is pool_submit_to.
+ */
+void pool_submit_near_to(Pool * p, Task * t, int node);
+
+/**
+ * @name    pool_submit_near
+ * @brief   Submits a created task to the default pool near NUMA node node
+ *          (see pool_submit_near_to)
+ */
+void pool_submit_near(Task * t, int node);
+
+/**
+ * @name    pool_parallel_for
+ * @brief   Runs body(from, to, ctx) over [begin, end) on the default pool,
+ *          cut into chunks [from, to) of grain elements (the last one may be
+ *          shorter).  Spans of chunks are split recursively into tasks.
+ *          A non-positive grain gives a few chunks per worker.  Returns once
+ *          every chunk has been run.  May be called from inside tasks.
+ */
+void pool_parallel_for(long begin, long end, long grain,
+                       void (*body)(long from, long to, void * ctx), void * ctx);
+
+/**
+ * @name    pool_parallel_reduce
+ * @brief   As pool_parallel_for, but map(from, to, ctx) gives a value per
+ *          chunk, and the values are combined pairwise, in the order of
+ *          their chunks, with combine(a, b, ctx), which must be associative.
+ * @retval  The combined value, identity if the range is empty
+ */
+long pool_parallel_reduce(long begin, long end, long grain,
+                          long (*map)(long from, long to, void * ctx),
+                          long (*combine)(long a, long b, void * ctx),
+                          long identity, void * ctx);
+
+/**
+ * @name    pool_parallel_for_to
+ * @brief   Runs a parallel loop on pool p (see pool_parallel_for).  Each
+ *          chunk is extended by overlap elements past its end, within the
+ *          range, for kernels looking at windows starting in the chunk.
+ */
+void pool_parallel_for_to(Pool * p, long begin, long end, long grain, long overlap,
+                          void (*body)(long from, long to, void * ctx), void * ctx);
+
+/**
+ * @name    pool_parallel_reduce_to
+ * @brief   Runs a parallel reduction on pool p, with chunks extended by
+ *          overlap elements (see pool_parallel_reduce, pool_parallel_for_to)
+ */
+long pool_parallel_reduce_to(Pool * p, long begin, long end, long grain, long overlap,
+                             long (*map)(long from, long to, void * ctx),
+                             long (*combine)(long a, long b, void * ctx),
+                             long identity, void * ctx);
+
+/**
+ * @name    pool_drain
+ * @brief   Waits until every task submitted to pool p so far, including
+ *          tasks submitted by those tasks, has been executed.
+ *          Must not be called from a worker of p.
+ */
+void pool_drain(Pool * p);
+
+/**
+ * @name    pool_destroy
+ * @brief   Stops the autoscaler and the timer thread, dropping pending
+ *          timers, drains pool p, retires and joins all of its workers and
+ *          frees it.  p may not be used afterwards.  If p is the
+ *          default pool, there is none until pool_init is called again.
+ *          Must not be called from a worker of p.
+ */
+void pool_destroy(Pool * p);
+
 
 #endif /* POOL_H_INCLUDED */
 
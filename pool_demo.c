@@ -16,13 +16,25 @@
 
 static int tasks = 1;
 static int threads = 1;
+static int blocking = 0;   // Tell the pool that tasks block
 
 /*
- * Read positional args: [tasks [threads]]
+ * Read options, then positional args: [tasks [threads]]
  */
 void read_args(int argc, char ** argv) {
   int n; 
 
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--blocking") == 0) {
+      blocking = 1;
+    } else {
+      printf("ERROR: Unknown option %s\n", argv[1]);
+      exit(1);
+    }
+    argc--;
+    argv++;
+  }
+
   if (argc <= 1) return;
   n = atoi(argv[1]);
   if (n > 1) tasks = n;
@@ -57,22 +69,29 @@ int main(int argc, char ** argv) {
   int i, ret;
 
   read_args(argc, argv);
-  printf("------ Running demo with %d tasks and %d threads ----\n\n", tasks, threads);
+  printf("------ Running demo with %d tasks and %d threads%s ----\n\n", tasks, threads,
+         blocking ? " (blocking)" : "");
 
   pool_init(threads);
+  if (blocking) pool_set_blocking_max(pool_default(), tasks);
 
   Task ** taskp = malloc(sizeof(Task *)*tasks);
+  TaskGroup * group = group_create();
   
   for (i = 0; i < tasks; i++) {
     taskp[i] = task_create((void *)(long int) i, compute);
-    pool_submit(taskp[i]);
+    group_add(group, taskp[i]);
+    if (blocking) {
+      pool_submit_blocking(taskp[i]);
+    } else {
+      pool_submit(taskp[i]);
+    }
  }
 
-  for (i = 0; i < tasks; i++) {
-    task_await(taskp[i]);
-  }
+  group_await_all(group);
   printf("\n---------- All tasks completed ----------\n");
   
+  group_dismiss(group);
   for (i = 0; i < tasks; i++) {
     task_dismiss(taskp[i]);
   }
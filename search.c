@@ -8,18 +8,42 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
 
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "pool.h"
+#include "topo.h"
+#include "kernel.h"
+#include "ac.h"
+#include "dfa.h"
 
 #define MAX_SIZE (10 * 1024 * 1024)  // Max  text size (10 MB)
 
 #define WARMUPS 2                    // Warmup searches to fill cache etc.
 #define RUNS    5                    // Number of regular runs to get stable average
 
+#define FIRST_BLOCK (64 * 1024)      // Text searched between cancellation checks
+
+#define WINDOW_SIZE (64 * 1024 * 1024)   // Default text searched at a time
+
+/* Input modes */
+#define INPUT_MEMORY 0               // Read into a buffer of MAX_SIZE
+#define INPUT_MMAP   1               // Mapped, searched a window at a time
+#define INPUT_STREAM 2               // Read a window at a time, the next while searching
+#define INPUT_CORPUS 3               // Many files, see search_corpus
+
+#define CORPUS_READERS 2                 // Reader tasks loading files
+#define CORPUS_CLAIM   16                // Files claimed by a reader at a time
+#define CORPUS_CHUNK   (1024 * 1024)     // Text per search task: large files are split, small ones batched
+#define CORPUS_SMALL   (64 * 1024)       // Smaller files are read rather than mapped
+
 
 /* Program parameters */
 static char * text_file_name;
@@ -27,64 +51,379 @@ static char * pattern;
 static int tasks = 1;
 static int threads = 1;
 static char * data_file_name = NULL;
-
-/* Search text */
+static int stealing = 0;
+static int first = 0;                // Only tell whether the pattern occurs
+static int affinity = POOL_AFFINITY_NONE;
+static int affinity_cpus[TOPO_MAX_CPUS];   // For POOL_AFFINITY_LIST
+static int affinity_n = 0;
+static const char * affinity_name = NULL;
+static int input_mode = INPUT_MEMORY;
+static long window_size = WINDOW_SIZE;
+static const char * kernel_name = "ref";   // See kernel.h, ref is search below
+static Kernel kernel = NULL;         // NULL for the reference search
+static int multi = 0;                // The pattern names a file of patterns
+static int regex_mode = 0;           // The pattern is a regular expression, see dfa.h
+
+/* Patterns of --multi mode */
+static char ** patterns = NULL;
+static int patterns_n = 0;
+static Automaton * automaton = NULL;
+static long * pattern_counts;        // Occurrences of each pattern found so far
+static pthread_key_t multi_key;      // Counting space of each thread, see count_patterns
+static pthread_once_t multi_once = PTHREAD_ONCE_INIT;
+
+/* Regular expression of --regex mode */
+static Dfa * regex = NULL;
+static int regex_state;              // DFA state at the end of the text searched so far
+
+/* Input */
 static FILE * file;
-static char * text;
-static int text_length;
+static char * input;                 // Whole text, unless streamed
+static long input_length;
+
+/* Corpus */
+typedef struct {
+  char * name;
+  char * data;                       // Contents while searched
+  long length;
+  int mapped;
+  int pending;                       // Tasks still searching the file
+  long count;                        // Occurrences found so far
+} CorpusFile;
+
+static CorpusFile * corpus = NULL;
+static int corpus_files = 0;
+static int next_file;                // Next file for a reader to claim
+
+/* Search text: the window searched by the current thread, see search_in */
+static __thread char * text;
+static __thread int text_length;
 static int pattern_length;
 
 /* Data file */
 static FILE * data_file = NULL;
 
+/* Search task used, and the token it cancels in --first mode */
+void * search (void * arg);
+void * search_kernel (void * arg);
+static void * (*search_task)(void *) = search_kernel;
+static CancelToken * found = NULL;
+
+/*
+ * Slices, windows and chunks are given by the positions where the
+ * occurrences they count start.  Their text extends pattern_length - 1
+ * characters further, as far as there is text, see count.
+ */
 typedef struct {
   int from;  // Start position
   int to;    // End position (up to, not included)
 } Interval;
 
+typedef struct {
+  char * text;        // Window of the text
+  int length;
+  Interval interval;  // Slice of the window to search
+} Slice;
+
+/* Part of a corpus file searched by one task */
+typedef struct {
+  CorpusFile * file;
+  long offset;
+  int length;         // Overlap included
+} Chunk;
+
+/* Consecutive small corpus files searched by one task */
+typedef struct {
+  int first;
+  int n;
+} Batch;
+
+/* Tasks submitted by a corpus reader, dismissed once the corpus is done */
+typedef struct {
+  Task ** tasks;
+  int n, size;
+} Reader;
+
+/* Chunk of a window searched for the regular expression */
+typedef struct {
+  char * text;
+  int length;
+  int state;          // DFA state at the start, then at the end
+  long count;
+} RegexChunk;
+
+/* Read of the next window in --stream mode */
+typedef struct {
+  char * buffer;
+  long offset;        // In the file
+  long length;        // Wanted, overlap included
+} Read;
+
 uint64_t micros(void) {
   struct timeval now;
   gettimeofday(&now,NULL);
   return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
 }  
 
+/* Opens the text file, and reads or maps it, see the input modes */
+void open_input(void) {
+  file = fopen(text_file_name, "r");
+  if (file == NULL) {
+    printf("ERROR: File %s could not be opened\n", text_file_name);
+    exit(1);
+  }
+
+  if (input_mode == INPUT_MEMORY) {
+    input = malloc(MAX_SIZE + 1);
+    if (input == NULL) {
+      printf("ERROR: File buffer could not be allocated\n");
+      exit(1);
+    }
+
+    input_length = fread(input, 1, MAX_SIZE, file);
+    if (input_length < 0 || ferror(file)) {
+      printf("ERROR: While reading text filen");
+      exit(1);
+    }    
+    if (!feof(file)) {
+      printf("Warning: File %s, was truncated, use --mmap or --stream\n", text_file_name);
+    }    
+
+    input[input_length] = '\0';
+  } else {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+      printf("ERROR: File %s could not be examined\n", text_file_name);
+      exit(1);
+    }
+    input_length = st.st_size;
+
+    if (input_mode == INPUT_MMAP && input_length > 0) {
+      input = mmap(NULL, input_length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+      if (input == MAP_FAILED) {
+        printf("ERROR: File %s could not be mapped\n", text_file_name);
+        exit(1);
+      }
+      madvise(input, input_length, MADV_SEQUENTIAL);
+    }
+  }
+}
+
+static void add_corpus_file(const char * name, long length) {
+  if (corpus_files % 1024 == 0) {
+    corpus = realloc(corpus, sizeof(CorpusFile) * (corpus_files + 1024));
+    if (corpus == NULL) {
+      printf("ERROR: Corpus could not be allocated\n");
+      exit(1);
+    }
+  }
+  CorpusFile * f = &corpus[corpus_files++];
+  f->name = strdup(name);
+  f->data = NULL;
+  f->length = length;
+  f->mapped = 0;
+  f->count = 0;
+  input_length += length;
+}
+
+/* Adds the regular files below directory dir, in name order */
+static void list_directory(const char * dir) {
+  struct dirent ** entries;
+  struct stat st;
+  char path[PATH_MAX];
+  int i, n = scandir(dir, &entries, NULL, alphasort);
+
+  if (n < 0) {
+    printf("ERROR: Directory %s could not be read\n", dir);
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    const char * name = entries[i]->d_name;
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        list_directory(path);
+      } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        add_corpus_file(path, st.st_size);
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+/* Lists the corpus: the files below a directory, or those in a file list */
+void list_corpus(const char * path) {
+  struct stat st;
+  char line[PATH_MAX];
+
+  if (stat(path, &st) != 0) {
+    printf("ERROR: Corpus %s could not be opened\n", path);
+    exit(1);
+  }
+  if (S_ISDIR(st.st_mode)) {
+    list_directory(path);
+    return;
+  }
+
+  /* A file list, one path per line */
+  FILE * list = fopen(path, "r");
+  if (list == NULL) {
+    printf("ERROR: Corpus %s could not be opened\n", path);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), list) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') continue;
+    if (stat(line, &st) != 0 || !S_ISREG(st.st_mode)) {
+      printf("Warning: Corpus file %s skipped, not a regular file\n", line);
+      continue;
+    }
+    add_corpus_file(line, st.st_size);
+  }
+  fclose(list);
+}
+
 /*
- * Read positional args: file pattern [tasks [threads [data_file]]]
+ * Reads the patterns of --multi mode, one per line, skipping empty lines,
+ * and builds their automaton.  pattern_length becomes the longest.
+ */
+void read_patterns(const char * path) {
+  char line[4096];
+  int size = 0;
+
+  FILE * list = fopen(path, "r");
+  if (list == NULL) {
+    printf("ERROR: Pattern file %s could not be opened\n", path);
+    exit(1);
+  }
+  pattern_length = 0;
+  while (fgets(line, sizeof(line), list) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') continue;
+    if (patterns_n == size) {
+      size = size > 0 ? 2 * size : 64;
+      patterns = realloc(patterns, sizeof(char *) * size);
+      if (patterns == NULL) {
+        printf("ERROR: Patterns could not be allocated\n");
+        exit(1);
+      }
+    }
+    patterns[patterns_n++] = strdup(line);
+    if ((int) strlen(line) > pattern_length) pattern_length = strlen(line);
+  }
+  fclose(list);
+
+  if (patterns_n == 0) {
+    printf("ERROR: Pattern file %s holds no patterns\n", path);
+    exit(1);
+  }
+  automaton = ac_create(patterns, patterns_n);
+  pattern_counts = calloc(patterns_n, sizeof(long));
+  if (automaton == NULL || pattern_counts == NULL) {
+    printf("ERROR: Pattern automaton could not be allocated\n");
+    exit(1);
+  }
+}
+
+/*
+ * Read options, then positional args: file pattern [tasks [threads [data_file]]]
  */
 void read_args(int argc, char ** argv) {
   int n; 
 
-  if (argc < 3) {
-    printf("Usage: search <text file> <pattern> [<tasks> [<threads> [<data file>] ] ]\n");
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--steal") == 0) {
+      stealing = 1;
+    } else if (strcmp(argv[1], "--first") == 0) {
+      first = 1;
+    } else if (strcmp(argv[1], "--mmap") == 0) {
+      input_mode = INPUT_MMAP;
+    } else if (strcmp(argv[1], "--stream") == 0) {
+      input_mode = INPUT_STREAM;
+    } else if (strcmp(argv[1], "--corpus") == 0) {
+      input_mode = INPUT_CORPUS;
+    } else if (strcmp(argv[1], "--multi") == 0) {
+      multi = 1;
+    } else if (strcmp(argv[1], "--regex") == 0) {
+      regex_mode = 1;
+    } else if (strncmp(argv[1], "--kernel=", 9) == 0) {
+      kernel_name = argv[1] + 9;
+    } else if (strncmp(argv[1], "--window=", 9) == 0) {
+      window_size = atol(argv[1] + 9);
+      if (window_size <= 0 || window_size > INT_MAX / 2) {
+        printf("ERROR: Invalid window size %s\n", argv[1] + 9);
+        exit(1);
+      }
+    } else if (strncmp(argv[1], "--affinity=", 11) == 0) {
+      affinity_name = argv[1] + 11;
+      if (strcmp(affinity_name, "none") == 0) {
+        affinity = POOL_AFFINITY_NONE;
+      } else if (strcmp(affinity_name, "compact") == 0) {
+        affinity = POOL_AFFINITY_COMPACT;
+      } else if (strcmp(affinity_name, "scatter") == 0) {
+        affinity = POOL_AFFINITY_SCATTER;
+      } else if ((affinity_n = topo_parse_list(affinity_name, affinity_cpus, TOPO_MAX_CPUS)) > 0) {
+        affinity = POOL_AFFINITY_LIST;
+      } else {
+        printf("ERROR: Invalid affinity %s\n", affinity_name);
+        exit(1);
+      }
+    } else {
+      printf("ERROR: Unknown option %s\n", argv[1]);
+      exit(1);
+    }
+    argc--;
+    argv++;
+  }
+
+  if (first && input_mode == INPUT_CORPUS) {
+    printf("ERROR: --first cannot be combined with --corpus\n");
     exit(1);
   }
-  
-  text_file_name = argv[1];
-  file = fopen(text_file_name, "r");
-  if (file == NULL) {
-    printf("ERROR: File %s could not be opened\n", text_file_name);
+  if (multi && (first || strcmp(kernel_name, "ref") != 0)) {
+    printf("ERROR: --multi cannot be combined with --first or --kernel\n");
+    exit(1);
+  }
+  if (regex_mode && (multi || first || input_mode == INPUT_CORPUS ||
+                     strcmp(kernel_name, "ref") != 0)) {
+    printf("ERROR: --regex cannot be combined with --multi, --first, --corpus or --kernel\n");
     exit(1);
   }
 
-  text = malloc(MAX_SIZE + 1);
-  if (text == NULL) {
-    printf("ERROR: File buffer could not be allocated\n");
+  if (argc < 3) {
+    printf("Usage: search [--steal] [--first] [--multi | --regex] [--affinity=none|compact|scatter|<cpu list>]\n"
+           "              [--kernel=ref|scalar|sse2|avx2|short|auto]\n"
+           "              [--mmap | --stream | --corpus] [--window=<bytes>] <text file | corpus> <pattern | pattern file | regex> [<tasks> [<threads> [<data file>] ] ]\n");
     exit(1);
   }
   
-  text_length = fread(text, 1, MAX_SIZE, file);
-  if (text_length < 0 || ferror(file)) {
-    printf("ERROR: While reading text filen");
-    exit(1);
-  }    
-  if (!feof(file)) {
-    printf("Warning: File %s, was truncated\n", text_file_name);
-  }    
+  text_file_name = argv[1];
+  if (input_mode == INPUT_CORPUS) {
+    list_corpus(text_file_name);
+  } else {
+    open_input();
+  }
 
-  text[text_length] = '\0';
-  
   pattern = argv[2];
-  pattern_length = strlen(pattern);
+  if (multi) {
+    read_patterns(pattern);
+  } else if (regex_mode) {
+    char error[128];
+    if ((regex = dfa_compile(pattern, error, sizeof(error))) == NULL) {
+      printf("ERROR: Regular expression %s: %s\n", pattern, error);
+      exit(1);
+    }
+    pattern_length = 1;              // Windows carry the DFA state, no overlap
+  } else {
+    pattern_length = strlen(pattern);
+  }
+
+  if (strcmp(kernel_name, "ref") != 0 &&
+      (kernel = kernel_find(kernel_name, pattern_length)) == NULL) {
+    printf("ERROR: Kernel %s unknown or not supported for this CPU and pattern\n", kernel_name);
+    exit(1);
+  }
   
   if (argc <= 3) return;
   n = atoi(argv[3]);
@@ -137,27 +476,555 @@ void * search (void * arg) {
   return (void *) (long int) times;
 }
 
+static void multi_key_init(void) {
+  pthread_key_create(&multi_key, free);
+}
+
+/*
+ * Counts the occurrences of the patterns of --multi mode starting in a
+ * slice, reading the text up to end, and adds them to pattern_counts.
+ * Each thread allocates its counts and the automaton's working space
+ * once, and frees them when it exits.
+ */
+long count_patterns(Interval * slice, int end) {
+  long * counts, times;
+  int i;
+
+  pthread_once(&multi_once, multi_key_init);
+  if ((counts = pthread_getspecific(multi_key)) == NULL) {
+    counts = malloc(sizeof(long) * (patterns_n + ac_work(automaton)));
+    if (counts == NULL) {
+      printf("ERROR: Pattern counts could not be allocated\n");
+      exit(1);
+    }
+    pthread_setspecific(multi_key, counts);
+  }
+  memset(counts, 0, sizeof(long) * patterns_n);
+  times = ac_count(automaton, text + slice->from, end - slice->from,
+                   slice->to - slice->from, counts, counts + patterns_n);
+  for (i = 0; i < patterns_n; i++) {
+    if (counts[i] != 0) __atomic_fetch_add(&pattern_counts[i], counts[i], __ATOMIC_RELAXED);
+  }
+  return times;
+}
+
+/*
+ * Counts the occurrences starting in a slice with the automaton in
+ * --multi mode, otherwise the selected kernel, the reference search if
+ * none.  These read up to pattern_length - 1 characters past the slice.
+ */
+long count(Interval * slice) {
+  Interval s = *slice;
+
+  s.to += pattern_length - 1;
+  if (s.to > text_length) s.to = text_length;
+  if (slice->to <= slice->from) return 0;
+  if (automaton != NULL) return count_patterns(slice, s.to);
+  if (kernel == NULL) return (long) search(&s);
+  return kernel(text + s.from, s.to - s.from, pattern, pattern_length);
+}
+
+/* Search task using the selected kernel */
+void * search_kernel (void * arg) {
+  return (void *) count(arg);
+}
+
+/*
+ * Search task of --first mode.  Searches the slice a block at a time and
+ * stops at the first block where the pattern occurs, cancelling the other
+ * tasks, or as soon as the search has been cancelled.
+ * Returns 1 if the pattern occurs in the slice, otherwise 0.
+ */
+void * search_first (void * arg) {
+  Interval * slice = arg;
+  Interval block;
+  int from;
+
+  for (from = slice->from; from < slice->to && !task_cancelled() &&
+       (found == NULL || !cancel_requested(found)); from += FIRST_BLOCK) {
+    block.from = from;
+    block.to = from + FIRST_BLOCK;
+    if (block.to > slice->to) block.to = slice->to;
+    if (count(&block) != 0) {
+      if (found != NULL) cancel_request(found);
+      return (void *) 1;
+    }
+  }
+  return (void *) 0;
+}
+
+/* Runs the search task on a slice of a window of the text */
+void * search_in (void * arg) {
+  Slice * s = arg;
+
+  text = s->text;
+  text_length = s->length;
+  return search_task(&s->interval);
+}
+
+/* Searches a chunk of a window of the text, overlap included */
+long search_chunk(long from, long to, void * ctx) {
+  Slice * window = ctx;
+  Slice s = *window;
+
+  s.interval.from = from;
+  s.interval.to = to;
+  return (long) search_in(&s);
+}
+
+/* Adds up the occurrences found in two chunks */
+long add(long a, long b, void * ctx) {
+  return a + b;
+}
+
+/* Searches chunks [from, to) of a window for the regular expression */
+void search_regex_chunks(long from, long to, void * ctx) {
+  RegexChunk * chunks = ctx;
+
+  for (; from < to; from++) {
+    RegexChunk * c = &chunks[from];
+    c->count = dfa_count(regex, c->text, c->length, &c->state);
+  }
+}
+
+/*
+ * Searches a window for the regular expression using n tasks.  Matches
+ * have no bounded length, so no overlap does: the chunks after the first
+ * are searched as if starting a line, then in order, where the previous
+ * chunk ended within a line, the part up to the first newline is searched
+ * again from that state.  regex_state is carried from window to window.
+ */
+long search_window_regex(char * base, int length, int n) {
+  RegexChunk * chunks = malloc(sizeof(RegexChunk) * n);
+  int step = (length + n - 1) / n;
+  long total = 0;
+  int k, m = 0;
+
+  if (chunks == NULL) {
+    printf("ERROR: Regular expression chunks could not be allocated\n");
+    exit(1);
+  }
+  for (k = 0; k * step < length; k++, m++) {
+    chunks[k].text = base + k * step;
+    chunks[k].length = length - k * step < step ? length - k * step : step;
+    chunks[k].state = k == 0 ? regex_state : dfa_start(regex);
+  }
+  pool_parallel_for(0, m, 1, search_regex_chunks, chunks);
+
+  for (k = 0; k < m; k++) {
+    RegexChunk * c = &chunks[k];
+    int actual = k == 0 ? regex_state : chunks[k - 1].state;
+    int assumed = k == 0 ? regex_state : dfa_start(regex);
+
+    if (actual != assumed) {
+      char * nl = memchr(c->text, '\n', c->length);
+      int line = nl != NULL ? nl - c->text + 1 : c->length;
+      c->count -= dfa_count(regex, c->text, line, &assumed);
+      c->count += dfa_count(regex, c->text, line, &actual);
+      if (nl == NULL) c->state = actual;
+    }
+    total += c->count;
+  }
+  if (m > 0) regex_state = chunks[m - 1].state;
+  free(chunks);
+  return total;
+}
+
+/*
+ * Searches a window of the text using n tasks, each reading
+ * pattern_length - 1 characters into the next so that occurrences across
+ * the boundary are found.  Windows are cut every window_size characters,
+ * so a window longer than that overlaps the next one.  In --first mode,
+ * the first chunk finding the pattern stops the others.
+ */
+long search_window(char * base, int length, int n) {
+  Slice window;
+
+  if (regex != NULL) return search_window_regex(base, length, n);
+  window.text = base;
+  window.length = length;
+  window.interval.from = 0;
+  window.interval.to = length > window_size ? window_size : length;
+
+  if (n == 1) {
+    Task * task = task_create_inline(&window, sizeof(Slice), search_in);
+    pool_submit(task);
+    task_await(task);
+    long result = (long) task->res;
+    task_dismiss(task);
+    return result;
+  }
+
+  if (first) found = cancel_create();
+  int starts = window.interval.to;
+  long total = pool_parallel_reduce_to(pool_default(), 0, starts, (starts + n - 1) / n,
+                                       0, search_chunk, add, 0, &window);
+  if (first) {
+    total = total > 0;
+    cancel_dismiss(found);
+    found = NULL;
+  }
+  return total;
+}
+
+/* Bytes of window k, overlap with the next included */
+long window_length(long k) {
+  long offset = k * window_size;
+  long length = window_size + pattern_length - 1;
+
+  return input_length - offset < length ? input_length - offset : length;
+}
+
+/* Reads a window in --stream mode, run as a blocking task */
+void * read_window (void * arg) {
+  Read * r = arg;
+  long done = 0;
+
+  while (done < r->length) {
+    ssize_t got = pread(fileno(file), r->buffer + done, r->length - done, r->offset + done);
+    if (got < 0) {
+      printf("ERROR: While reading text file\n");
+      exit(1);
+    }
+    if (got == 0) break;
+    done += got;
+  }
+  return (void *) done;
+}
+
+/*
+ * Searches the whole input a window at a time using n tasks per window.
+ * A window covers window_size positions where occurrences may start, plus
+ * pattern_length - 1 characters of the next window, so every occurrence
+ * is counted exactly once.  --mmap advises the kernel to read the next
+ * window ahead; --stream reads it in a blocking task meanwhile.
+ */
+long search_input(int n) {
+  static char * buffers[2];
+  long k, windows = (input_length + window_size - 1) / window_size;
+  long total = 0;
+  Task * next = NULL;
+  Read r;
+
+  if (windows == 0) windows = 1;     // Empty input, still searched once
+
+  if (input_mode == INPUT_STREAM && buffers[0] == NULL) {
+    buffers[0] = malloc(window_size + pattern_length);
+    buffers[1] = malloc(window_size + pattern_length);
+    if (buffers[0] == NULL || buffers[1] == NULL) {
+      printf("ERROR: Window buffers could not be allocated\n");
+      exit(1);
+    }
+  }
+  if (regex != NULL) regex_state = dfa_start(regex);
+  if (input_mode == INPUT_STREAM) {
+    r.buffer = buffers[0];
+    r.offset = 0;
+    r.length = window_length(0);
+    read_window(&r);
+  }
+
+  for (k = 0; k < windows; k++) {
+    long length = window_length(k);
+    char * base;
+
+    if (input_mode == INPUT_STREAM) {
+      base = buffers[k % 2];
+      if (k + 1 < windows) {
+        r.buffer = buffers[(k + 1) % 2];
+        r.offset = (k + 1) * window_size;
+        r.length = window_length(k + 1);
+        next = task_create_inline(&r, sizeof(Read), read_window);
+        pool_submit_blocking(next);
+      }
+    } else {
+      base = input + k * window_size;
+      if (input_mode == INPUT_MMAP && k + 1 < windows) {
+        madvise(input + (k + 1) * window_size, window_length(k + 1), MADV_WILLNEED);
+      }
+    }
+
+    total += search_window(base, length, n);
+
+    if (next != NULL) {
+      task_await(next);
+      if ((long) next->res != window_length(k + 1)) {
+        printf("ERROR: Text file changed while searched\n");
+        exit(1);
+      }
+      task_dismiss(next);
+      next = NULL;
+    }
+    if (first && total > 0) break;
+  }
+  if (regex != NULL) total += dfa_end(regex, regex_state);
+
+  /* Let a streamed read in flight finish before the buffers are reused */
+  if (next != NULL) {
+    task_await(next);
+    task_dismiss(next);
+  }
+  return total;
+}
+
+
+
+/* Reads or maps a corpus file */
+void load_file(CorpusFile * f) {
+  int fd = open(f->name, O_RDONLY);
+  long done = 0;
+
+  if (fd < 0) {
+    printf("ERROR: Corpus file %s could not be opened\n", f->name);
+    exit(1);
+  }
+  f->data = NULL;
+  f->mapped = f->length >= CORPUS_SMALL;
+  if (f->mapped) {
+    f->data = mmap(NULL, f->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f->data == MAP_FAILED) {
+      printf("ERROR: Corpus file %s could not be mapped\n", f->name);
+      exit(1);
+    }
+    madvise(f->data, f->length, MADV_SEQUENTIAL);
+  } else if (f->length > 0) {
+    f->data = malloc(f->length);
+    if (f->data == NULL) {
+      printf("ERROR: Corpus file buffer could not be allocated\n");
+      exit(1);
+    }
+    while (done < f->length) {
+      ssize_t got = read(fd, f->data + done, f->length - done);
+      if (got <= 0) {
+        printf("ERROR: While reading corpus file %s\n", f->name);
+        exit(1);
+      }
+      done += got;
+    }
+  }
+  close(fd);
+}
+
+/* Releases the contents of a corpus file once its last task is done */
+void file_done(CorpusFile * f) {
+  if (__atomic_sub_fetch(&f->pending, 1, __ATOMIC_ACQ_REL) > 0) return;
+  if (f->mapped) {
+    munmap(f->data, f->length);
+  } else {
+    free(f->data);
+  }
+  f->data = NULL;
+}
+
+/* Searches a chunk of a large corpus file */
+void * search_file_chunk (void * arg) {
+  Chunk * c = arg;
+  Slice s;
+
+  s.text = c->file->data + c->offset;
+  s.length = c->length;
+  s.interval.from = 0;
+  s.interval.to = c->length > CORPUS_CHUNK ? CORPUS_CHUNK : c->length;
+  long times = (long) search_in(&s);
+  __atomic_fetch_add(&c->file->count, times, __ATOMIC_RELAXED);
+  file_done(c->file);
+  return (void *) times;
+}
+
+/* Searches a batch of small corpus files */
+void * search_file_batch (void * arg) {
+  Batch * b = arg;
+  Slice s;
+  long total = 0;
+  int i;
+
+  for (i = b->first; i < b->first + b->n; i++) {
+    CorpusFile * f = &corpus[i];
+    s.text = f->data;
+    s.length = f->length;
+    s.interval.from = 0;
+    s.interval.to = f->length;
+    f->count = f->length > 0 ? (long) search_in(&s) : 0;
+    total += f->count;
+    file_done(f);
+  }
+  return (void *) total;
+}
+
+static void reader_submit(Reader * r, Task * t) {
+  if (r->n == r->size) {
+    r->size = r->size > 0 ? 2 * r->size : 64;
+    r->tasks = realloc(r->tasks, sizeof(Task *) * r->size);
+    if (r->tasks == NULL) {
+      printf("ERROR: Corpus reader could not allocate task list\n");
+      exit(1);
+    }
+  }
+  r->tasks[r->n++] = t;
+  pool_submit(t);
+}
+
+static void reader_flush(Reader * r, Batch * b) {
+  if (b->n > 0) reader_submit(r, task_create_inline(b, sizeof(Batch), search_file_batch));
+  b->n = 0;
+}
+
+/*
+ * Corpus reader, run as a blocking task.  Claims a run of files at a time
+ * and loads them, submitting a task per CORPUS_CHUNK of text as it goes:
+ * files of several chunks are split, runs of smaller files are batched.
+ */
+void * corpus_reader (void * arg) {
+  Reader * r = arg;
+  Batch batch = { 0, 0 };
+  long batch_length = 0;
+  int first, i;
+
+  while ((first = __atomic_fetch_add(&next_file, CORPUS_CLAIM, __ATOMIC_RELAXED)) < corpus_files) {
+    int last = first + CORPUS_CLAIM < corpus_files ? first + CORPUS_CLAIM : corpus_files;
+
+    for (i = first; i < last; i++) {
+      CorpusFile * f = &corpus[i];
+      f->count = 0;
+      load_file(f);
+
+      if (f->length < 2 * CORPUS_CHUNK) {
+        if (batch.n == 0) {
+          batch.first = i;
+          batch_length = 0;
+        }
+        f->pending = 1;
+        batch.n++;
+        batch_length += f->length;
+        if (batch_length >= CORPUS_CHUNK) reader_flush(r, &batch);
+        continue;
+      }
+
+      /* Batches are runs of consecutive files */
+      reader_flush(r, &batch);
+      long chunks = (f->length + CORPUS_CHUNK - 1) / CORPUS_CHUNK;
+      f->pending = chunks;
+      for (long k = 0; k < chunks; k++) {
+        Chunk c;
+        c.file = f;
+        c.offset = k * CORPUS_CHUNK;
+        c.length = f->length - c.offset < CORPUS_CHUNK + pattern_length - 1 ?
+                   f->length - c.offset : CORPUS_CHUNK + pattern_length - 1;
+        reader_submit(r, task_create_inline(&c, sizeof(Chunk), search_file_chunk));
+      }
+    }
+    reader_flush(r, &batch);
+  }
+  return NULL;
+}
+
+/*
+ * Searches the corpus.  With one task, file by file and window by window;
+ * otherwise pipelined: CORPUS_READERS readers load files and feed search
+ * tasks to the pool as the files arrive.  Gives the total count, and
+ * leaves the count of each file in the corpus.
+ */
+long search_corpus(int n) {
+  Reader readers[CORPUS_READERS];
+  Task * reader_tasks[CORPUS_READERS];
+  long total = 0;
+  int i, j;
+
+  if (n == 1) {
+    for (i = 0; i < corpus_files; i++) {
+      CorpusFile * f = &corpus[i];
+      load_file(f);
+      f->pending = 1;
+      f->count = 0;
+      for (long offset = 0; offset < f->length; offset += window_size) {
+        long length = f->length - offset < window_size + pattern_length - 1 ?
+                      f->length - offset : window_size + pattern_length - 1;
+        f->count += search_window(f->data + offset, length, 1);
+      }
+      total += f->count;
+      file_done(f);
+    }
+    return total;
+  }
+
+  next_file = 0;
+  for (i = 0; i < CORPUS_READERS; i++) {
+    readers[i].tasks = NULL;
+    readers[i].n = readers[i].size = 0;
+    reader_tasks[i] = task_create(&readers[i], corpus_reader);
+    pool_submit_blocking(reader_tasks[i]);
+  }
+  for (i = 0; i < CORPUS_READERS; i++) {
+    task_await(reader_tasks[i]);
+    task_dismiss(reader_tasks[i]);
+    for (j = 0; j < readers[i].n; j++) {
+      task_await(readers[i].tasks[j]);
+      task_dismiss(readers[i].tasks[j]);
+    }
+    free(readers[i].tasks);
+  }
+
+  for (i = 0; i < corpus_files; i++) {
+    total += corpus[i].count;
+  }
+  return total;
+}
+
+/* Searches the input of any mode using n tasks */
+long search_all(int n) {
+  if (multi) memset(pattern_counts, 0, sizeof(long) * patterns_n);
+  return input_mode == INPUT_CORPUS ? search_corpus(n) : search_input(n);
+}
 
 
 int main(int argc, char ** argv) {
   int i, k, ret;
   uint64_t start, end;
-  int result_single, result_multiple;
-  unsigned int total_time_single, total_time_multiple;
+  long result_single, result_multiple;
+  long * pattern_counts_single = NULL;
+  unsigned long total_time_single, total_time_multiple;
 
   read_args(argc, argv);
+  if (first) search_task = search_first;
+  const char * result_name = first ? "Found" : "Occurences";
   
   printf("Running search with: \n"
-	 "  file = %s, file length = %d\n"
-	 "  pattern = '%s', pattern length = %d\n"
-	 "  tasks = %d, threads = %d\n", text_file_name, text_length,
-	 pattern, pattern_length, tasks, threads);
+	 "  file = %s, file length = %ld%s\n", text_file_name, input_length,
+	 input_mode == INPUT_MMAP ? " (mapped)" : input_mode == INPUT_STREAM ? " (streamed)" :
+	 input_mode == INPUT_CORPUS ? " (corpus)" : "");
+  if (regex != NULL) {
+    printf("  regex = '%s', required literal = '%s'\n", pattern, dfa_literal(regex));
+  } else if (multi) {
+    printf("  pattern file = %s, patterns = %d, longest = %d, states = %d\n",
+           pattern, patterns_n, pattern_length, ac_states(automaton));
+  } else {
+    printf("  pattern = '%s', pattern length = %d\n", pattern, pattern_length);
+  }
+  printf("  tasks = %d, threads = %d%s%s\n", tasks, threads,
+	 stealing ? " (work stealing)" : "", first ? " (first match)" : "");
+  if (input_mode == INPUT_CORPUS) {
+    printf("  corpus files = %d\n", corpus_files);
+  }
+  if (input_mode != INPUT_MEMORY || window_size != WINDOW_SIZE) {
+    printf("  window = %ld\n", window_size);
+  }
+  printf("  kernel = %s\n", kernel_name);
+  if (affinity_name != NULL) {
+    printf("  affinity = %s\n", affinity_name);
+  }
   if (data_file != NULL) {
     printf("  Data file = %s\n", data_file_name);
   }
   printf("\n");
 
-  pool_init(threads);
+  if (stealing) {
+    pool_init_stealing(threads);
+  } else {
+    pool_init(threads);
+  }
+  if (affinity != POOL_AFFINITY_NONE) {
+    pool_set_affinity(pool_default(), affinity, affinity_cpus, affinity_n);
+  }
 
   /***************** Warmup search using single task  ******************/
 
@@ -169,23 +1036,13 @@ int main(int argc, char ** argv) {
 
     start = micros();
   
-    Interval * full = malloc(sizeof(Interval));
-    full->from = 0;
-    full->to = text_length;
-    Task * task = task_create(full, search);
-    pool_submit(task);
-
-    task_await(task);
-
-    int result = (long int) task->res;
-    free(task->arg);
-    task_dismiss(task);
+    long result = search_all(1);
 
     end = micros();
 
     total_time_single += end - start;
 
-    printf(" Occurences = %d, time = %lu [us]\n", result, end - start);
+    printf(" %s = %ld, time = %lu [us]\n", result_name, result, end - start);
 
  }
 
@@ -203,27 +1060,26 @@ int main(int argc, char ** argv) {
 
     start = micros();
   
-    Interval * full = malloc(sizeof(Interval));
-    full->from = 0;
-    full->to = text_length;
-    Task * task = task_create(full, search);
-    pool_submit(task);
-
-    task_await(task);
-
-    int result = (long int) task->res;
-    free(task->arg);
-    task_dismiss(task);
+    long result = search_all(1);
 
     end = micros();
 
-    printf(" Occurences = %d, time = %lu [us]\n", result, end - start);
+    printf(" %s = %ld, time = %lu [us]\n", result_name, result, end - start);
  
     total_time_single += end - start;
 
     result_single = result;
   }
 
+  if (multi) {
+    pattern_counts_single = malloc(sizeof(long) * patterns_n);
+    if (pattern_counts_single == NULL) {
+      printf("ERROR: Pattern counts could not be allocated\n");
+      exit(1);
+    }
+    memcpy(pattern_counts_single, pattern_counts, sizeof(long) * patterns_n);
+  }
+
   printf("Average of regular single task runs: %.1f [us]\n\n",
 	 (float) total_time_single/RUNS);
 
@@ -232,42 +1088,17 @@ int main(int argc, char ** argv) {
 
   total_time_multiple = 0;
 
-  Task ** taskp = malloc(sizeof(Task *)*tasks);
-  
   for (k = 0; k < RUNS; k++) {
   
     printf("Proper run no. %d using %d tasks.", k, tasks);
 
     start = micros();
   
-    for (i = 0; i < tasks; i++) {
-      Interval * chunk = malloc(sizeof(Interval));
-		int chunkSize = text_length / tasks;
-          chunk->from = i * chunkSize;                     // TODO: find proper limits
-		if ( i == tasks - 1) {
-		  chunk->to = text_length; // To avoid going outside text
-		} else {
-		  chunk->to = (i + 1) * chunkSize + (pattern_length - 1);
-		}
-      taskp[i] = task_create(chunk, search);
-      pool_submit(taskp[i]);
-    }
-
-    for (i = 0; i < tasks; i++) {
-      task_await(taskp[i]);
-    }
-  
-    int total = 0;
-    
-    for (i = 0; i < tasks; i++) {
-      total += (uintptr_t) taskp[i]->res;    // Add occurrences
-      free(taskp[i]->arg);                   // Free interval
-      task_dismiss(taskp[i]);
-    }
+    long total = search_all(tasks);
     
     end = micros();
 
-    printf(" Occurences = %d, time = %lu [us]\n", total, end - start);
+    printf(" %s = %ld, time = %lu [us]\n", result_name, total, end - start);
     total_time_multiple += end - start;
      
     result_multiple = total; 
@@ -284,16 +1115,80 @@ int main(int argc, char ** argv) {
   printf("  Speedup = %f\n\n", speedup);
     
   if (result_single != result_multiple) {
-    printf("  WARNING: RESULTS DIFFER. Single: %d, multiple: %d\n\n",
+    printf("  WARNING: RESULTS DIFFER. Single: %ld, multiple: %ld\n\n",
 	   result_single, result_multiple);
   }
 
+  if (input_mode == INPUT_CORPUS) {
+    printf("%s per file:\n", result_name);
+    for (i = 0; i < corpus_files; i++) {
+      printf("  %s: %ld\n", corpus[i].name, corpus[i].count);
+    }
+    printf("  Total: %ld\n\n", result_multiple);
+  }
+
+  if (multi) {
+    printf("%s per pattern:\n", result_name);
+    for (i = 0; i < patterns_n; i++) {
+      printf("  '%s': %ld\n", patterns[i], pattern_counts[i]);
+      if (pattern_counts[i] != pattern_counts_single[i]) {
+        printf("  WARNING: RESULTS DIFFER. Single: %ld, multiple: %ld\n",
+               pattern_counts_single[i], pattern_counts[i]);
+      }
+    }
+    printf("  Total: %ld\n\n", result_multiple);
+  }
+
+  if (regex != NULL) {
+    printf("DFA states built: %d\n\n", dfa_states(regex));
+  }
+
   if (result_single == result_multiple && data_file !=NULL) {
     fprintf(data_file, "%d, %d, %.1f, %.1f, %f\n", tasks, threads, (float) total_time_single/RUNS, 
              (float) total_time_multiple/RUNS, speedup);
     printf("\nSearch data written to %s\n", data_file_name);
   }
-  
+
+  /***************** Kernels using single task ******************/
+
+  if (multi || regex != NULL) return 0;   // Kernels search for a single string
+
+  printf("\nKernels, average of %d single task runs:\n", RUNS);
+
+  Kernel selected = kernel;
+  float time_ref = 0;
+  long result_ref = 0;
+
+  for (i = -1; i < 0 || kernel_names[i] != NULL; i++) {  // -1 for ref
+    const char * name = i < 0 ? "ref" : kernel_names[i];
+
+    kernel = i < 0 ? NULL : kernel_find(name, pattern_length);
+    if (i >= 0 && kernel == NULL) {
+      printf("  %-8s not supported\n", name);
+      continue;
+    }
+
+    long result = 0;
+    unsigned long total_time = 0;
+    for (k = 0; k < RUNS; k++) {
+      start = micros();
+      result = search_all(1);
+      end = micros();
+      total_time += end - start;
+    }
+    float time = (float) total_time/RUNS;
+    if (i < 0) {
+      time_ref = time;
+      result_ref = result;
+    }
+
+    printf("  %-8s %12.1f [us]  speedup = %8.2f\n", name, time, time > 0 ? time_ref / time : 0);
+    if (result != result_ref) {
+      printf("  WARNING: RESULTS DIFFER. Reference: %ld, %s: %ld\n", result_ref, name, result);
+    }
+  }
+  kernel = selected;
+
 
   return 0;
 }
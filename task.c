@@ -11,69 +11,577 @@
 /* Uses */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "park.h"
 
 /* Stages */
-#define CREATED    0
-#define EXECUTING  1
-#define COMPLETED  2
-#define DISMISSED  3
+#define BLOCKED    0   // Waiting for dependencies
+#define CREATED    1
+#define EXECUTING  2
+#define COMPLETED  3
+#define DISMISSED  4
+
+#define STAGE_MASK 7
+#define WAITERS    8   // Flag set in the stage word by sleeping awaiters
 
 /*
- * All task are maintained under a common lock
+ * The stage word is only changed atomically: BLOCKED -> CREATED when the
+ * last dependency completes, CREATED -> EXECUTING by CAS, so a task is
+ * executed once, and -> COMPLETED by exchange, which tells the
+ * executor whether anyone sleeps on the word and needs a wake-up.
+ * Awaiting threads spin on the stage for a while before they set the
+ * WAITERS flag and sleep on it.
  */
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static ParkPolicy await_policy;
+static pthread_once_t policy_once = PTHREAD_ONCE_INIT;
+
+static void policy_init(void) {
+  park_init(&await_policy, -1);
+}
+
+static int task_done(void * arg) {
+  Task * t = arg;
+  return (__atomic_load_n(&t->stage, __ATOMIC_ACQUIRE) & STAGE_MASK) >= COMPLETED;
+}
+
+/*
+ * Task allocation.  Tasks are carved from slabs and never returned to the
+ * system.  Each thread keeps a cache of free tasks; a cache that grows too
+ * big (a thread dismissing tasks created by others) moves half of its tasks
+ * to a shared depot, which an empty cache refills from before it allocates
+ * a new slab.  A thread's cache goes to the depot when the thread exits.
+ */
+#define TASK_SLAB       64   // Tasks allocated at a time
+#define TASK_CACHE_MAX 512   // Free tasks kept by a thread
+
+typedef struct {
+  Task * head;
+  int count;
+  int registered;            // Flushed to the depot at thread exit
+} TaskCache;
+
+static __thread TaskCache cache;
+
+static Task * depot = NULL;
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* Moves the first n tasks of the cache to the depot */
+static void cache_flush(int n) {
+  Task * first = cache.head;
+  Task * last = first;
+  int i;
+
+  if (n <= 0) return;
+  for (i = 1; i < n; i++) last = last->next;
+  cache.head = last->next;
+  cache.count -= n;
+
+  pthread_mutex_lock(&depot_mutex);
+  last->next = depot;
+  depot = first;
+  pthread_mutex_unlock(&depot_mutex);
+}
+
+static void cache_exit(void * arg) {
+  cache_flush(cache.count);
+}
+
+static void cache_key_init(void) {
+  pthread_key_create(&cache_key, cache_exit);
+}
+
+/* Refills the empty cache from the depot, or from a new slab */
+static void cache_refill(void) {
+  Task * t;
+  int i;
+
+  if (!cache.registered) {
+    pthread_once(&cache_once, cache_key_init);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = 1;
+  }
+
+  if (__atomic_load_n(&depot, __ATOMIC_RELAXED) != NULL) {
+    pthread_mutex_lock(&depot_mutex);
+    for (i = 0; i < TASK_SLAB && (t = depot) != NULL; i++) {
+      depot = t->next;
+      t->next = cache.head;
+      cache.head = t;
+      cache.count++;
+    }
+    pthread_mutex_unlock(&depot_mutex);
+    if (cache.count > 0) return;
+  }
+
+  t = malloc(sizeof(Task) * TASK_SLAB);
+  if (t == NULL) {
+    printf("ERROR: Task slab could not be allocated\n");
+    exit(1);
+  }
+  for (i = 0; i < TASK_SLAB; i++) {
+    t[i].next = cache.head;
+    cache.head = &t[i];
+  }
+  cache.count += TASK_SLAB;
+}
+
+static Task * task_alloc(void) {
+  Task * t;
+
+  if (cache.head == NULL) cache_refill();
+  t = cache.head;
+  cache.head = t->next;
+  cache.count--;
+  return t;
+}
+
+static void task_free(Task * t) {
+  t->next = cache.head;
+  cache.head = t;
+  if (++cache.count > TASK_CACHE_MAX) cache_flush(TASK_CACHE_MAX / 2);
+}
+
+/*
+ * Dependencies.  Each task keeps a stack of links to its successors, which
+ * is closed when the task completes.  The first successor uses the link
+ * inside the task, so fan-in graphs need no allocation.
+ */
+static TaskLink closed;
+#define CLOSED (&closed)
+
+static void (*ready_hook)(Task *) = NULL;
+
+/* Runs another task for an awaiting pool worker, see task_set_help_hook */
+static int (*help_hook)(void) = NULL;
+
+#define HELP_POLL_US 1000   // Sleep of a helping awaiter with nothing to run
+
+static void dependency_done(Task * t, void * owner) {
+  void * none = NULL;
+
+  if (owner != NULL) {
+    __atomic_compare_exchange_n(&t->owner, &none, owner, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  if (__atomic_sub_fetch(&t->deps, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+  __atomic_fetch_add(&t->stage, CREATED - BLOCKED, __ATOMIC_RELEASE);
+  void (*hook)(Task *) = __atomic_load_n(&ready_hook, __ATOMIC_ACQUIRE);
+  if (hook != NULL) {
+    hook(t);
+  } else {
+    task_execute(t);
+  }
+}
+
+static void add_successor(Task * parent, Task * t) {
+  Task * none = NULL;
+  TaskLink * link;
+
+  if (__atomic_compare_exchange_n(&parent->first.task, &none, t, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    link = &parent->first;
+  } else {
+    link = malloc(sizeof(TaskLink));
+    if (link == NULL) {
+      printf("ERROR: Task dependency could not be allocated\n");
+      exit(1);
+    }
+    link->task = t;
+  }
+
+  TaskLink * head = __atomic_load_n(&parent->successors, __ATOMIC_ACQUIRE);
+  do {
+    if (head == CLOSED) {
+      /* Already completed */
+      if (link != &parent->first) free(link);
+      dependency_done(t, parent->owner);
+      return;
+    }
+    link->next = head;
+  } while (!__atomic_compare_exchange_n(&parent->successors, &head, link, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Cancellation.  Tokens are only polled: before a task starts, and by
+ * computations through task_cancelled, which finds the token of the task
+ * run by the calling thread.
+ */
+struct CancelToken {
+  int cancelled;
+};
+
+static __thread Task * current = NULL;   // Task executed by this thread
+
+/*
+ * Groups.  Completed tasks are pushed on a stack of the group before the
+ * count of pending tasks is decremented.  group_await_all sleeps on the
+ * count and is only woken when it reaches zero, group_await_any sleeps on
+ * the number of completions.  A task's group pointer is swapped for
+ * GROUP_DONE on completion, so group_add can tell a completed task.
+ */
+struct TaskGroup {
+  int pending;               // Tasks not yet completed, futex word
+  int completions;           // Futex word counting completions
+  int any_waiters;           // Threads in group_await_any
+  Task * completed;          // Completed tasks not yet returned
+  CancelToken * cancel;      // Given to tasks added, if set
+};
+
+static TaskGroup group_done;
+#define GROUP_DONE (&group_done)
+
+/*
+ * Links t into the completed tasks of g.  t is completed already, and a
+ * thread awaiting it may dismiss it meanwhile, so the link has a field of
+ * its own rather than the one the allocator threads its free lists on.
+ */
+static void group_task_done(TaskGroup * g, Task * t) {
+  Task * head = __atomic_load_n(&g->completed, __ATOMIC_RELAXED);
+  do {
+    t->group_next = head;
+  } while (!__atomic_compare_exchange_n(&g->completed, &head, t, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  __atomic_fetch_add(&g->completions, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&g->any_waiters, __ATOMIC_SEQ_CST) > 0) {
+    park_wake(&g->completions, INT_MAX);
+  }
+
+  /* g may be dismissed right after the last decrement, so only its
+     address is used; a wake-up of a reused word is merely spurious */
+  if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+    park_wake(&g->pending, INT_MAX);
+  }
+}
+
+/*
+ * Completes t and releases its successors.  The successor stack is closed
+ * before t is completed, but walked after, so successors may rely on t
+ * being completed.  t itself may be gone by then, so the inline link is
+ * copied first.
+ */
+static void complete(Task * t) {
+  TaskLink * link = __atomic_exchange_n(&t->successors, CLOSED, __ATOMIC_ACQ_REL);
+  TaskLink * inline_link = &t->first;
+  TaskLink first = t->first;
+  void * owner = t->owner;
+  TaskGroup * g = __atomic_exchange_n(&t->group, GROUP_DONE, __ATOMIC_ACQ_REL);
+
+  /* The awaiter may dismiss the task as soon as it sees it completed, so a
+     wake-up may hit a reused word; that only costs a spurious wake-up. */
+  if (__atomic_exchange_n(&t->stage, COMPLETED, __ATOMIC_ACQ_REL) & WAITERS) {
+    park_wake(&t->stage, INT_MAX);
+  }
+
+  if (g != NULL) group_task_done(g, t);
+
+  while (link != NULL) {
+    if (link == inline_link) {
+      link = &first;
+    }
+    TaskLink * next = link->next;
+    Task * s = link->task;
+    if (link != &first) free(link);
+    dependency_done(s, owner);
+    link = next;
+  }
+}
 
 /* External operation implementations */
 
-/* Creation needs not be locked, as no other threads may yet have 
+/* Creation needs no atomics, as no other threads may yet have
  * access to this task.
  */
 Task * task_create(void * a, void * (*f)(void *) ) {
-  Task * t = malloc(sizeof(Task));
+  Task * t = task_alloc();
   t->arg = a;
   t->res = NULL;
   t->comp = f;
   t->stage = CREATED; 
-  pthread_cond_init(&t->done, NULL);
+  t->deps = 0;
+  t->successors = NULL;
+  t->first.task = NULL;
+  t->owner = NULL;
+  t->group = NULL;
+  t->cancel = NULL;
+  t->skipped = 0;
+  t->blocking = 0;
+  t->timer = NULL;
+  t->next = NULL;
   return t;
 }
 
-void task_execute(Task * t) {
-  int old_stage;
-  pthread_mutex_lock(&mutex);
-  old_stage = t->stage;
-  if (old_stage == CREATED) {
-    t->stage = EXECUTING;
+Task * task_create_inline(const void * a, size_t size, void * (*f)(void *) ) {
+  if (size > TASK_INLINE_SIZE) {
+    printf("ERROR: Task argument of %zu bytes does not fit in task\n", size);
+    exit(1);
+  }
+  Task * t = task_create(NULL, f);
+  memcpy(t->data, a, size);
+  t->arg = t->data;
+  return t;
+}
+
+Task * task_create_after(Task ** deps, int n, void * a, void * (*f)(void *) ) {
+  Task * t = task_create(a, f);
+  int i;
+
+  /* Hold one extra dependency until all links are in place */
+  t->stage = BLOCKED;
+  t->deps = n + 1;
+  for (i = 0; i < n; i++) {
+    add_successor(deps[i], t);
   }
-  pthread_mutex_unlock(&mutex);
+  dependency_done(t, NULL);
+  return t;
+}
 
-  if (old_stage != CREATED) return;
+Task * task_then(Task * parent, void * (*f)(void *) ) {
+  return task_create_after(&parent, 1, parent, f);
+}
 
-  t->res = (*(t->comp))(t->arg);
+void task_set_ready_hook(void (*hook)(Task *) ) {
+  __atomic_store_n(&ready_hook, hook, __ATOMIC_RELEASE);
+}
 
-  pthread_mutex_lock(&mutex);
-  t->stage = COMPLETED;
-  pthread_cond_broadcast(&t->done);
-  pthread_mutex_unlock(&mutex);
+void task_set_help_hook(int (*hook)(void) ) {
+  __atomic_store_n(&help_hook, hook, __ATOMIC_RELEASE);
 }
 
+void task_execute(Task * t) {
+  int stage = __atomic_load_n(&t->stage, __ATOMIC_RELAXED);
+
+  do {
+    if ((stage & STAGE_MASK) != CREATED) return;
+  } while (!__atomic_compare_exchange_n(&t->stage, &stage, (stage & ~STAGE_MASK) | EXECUTING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  if (t->cancel != NULL && cancel_requested(t->cancel)) {
+    /* Cancelled before it started */
+    t->skipped = 1;
+  } else {
+    Task * outer = current;
+    current = t;
+    t->res = (*(t->comp))(t->arg);
+    current = outer;
+  }
+
+  complete(t);
+}
+
+
+/* Sleeps on the stage word of t until it is completed or deadline passes */
+static void sleep_on(Task * t, const struct timespec * deadline) {
+  int stage = __atomic_load_n(&t->stage, __ATOMIC_ACQUIRE);
+  int slept = 0;
+
+  while ((stage & STAGE_MASK) < COMPLETED) {
+    if (!(stage & WAITERS) &&
+        !__atomic_compare_exchange_n(&t->stage, &stage, stage | WAITERS, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    if (!slept++) park_slept(&await_policy);
+    if (park_wait(&t->stage, stage | WAITERS, deadline) == ETIMEDOUT) return;
+    stage = __atomic_load_n(&t->stage, __ATOMIC_ACQUIRE);
+  }
+}
 
 void task_await(Task * t) {
-  pthread_mutex_lock(&mutex);
-  while (t->stage < COMPLETED) {
-    pthread_cond_wait(&t->done, & mutex);
+  int (*help)(void) = __atomic_load_n(&help_hook, __ATOMIC_ACQUIRE);
+  struct timespec deadline;
+  int helped;
+
+  pthread_once(&policy_once, policy_init);
+  if (task_done(t)) return;
+
+  /* Pool workers run other tasks while they wait, so tasks awaiting
+     subtasks cannot deadlock the pool.  When there is nothing to run,
+     the awaited task is running elsewhere; look again now and then. */
+  if (help != NULL) {
+    while (!task_done(t) && (helped = help()) >= 0) {
+      if (helped == 0 && !park_spin(&await_policy, task_done, t)) {
+        park_deadline(&deadline, HELP_POLL_US);
+        sleep_on(t, &deadline);
+      }
+    }
+    if (task_done(t)) return;
   }
-  pthread_mutex_unlock(&mutex);
+
+  if (park_spin(&await_policy, task_done, t)) return;
+  sleep_on(t, NULL);
+}
+
+int task_completed(Task * t) {
+  return task_done(t);
 }
 
 void task_dismiss(Task * t) {
-  pthread_mutex_lock(&mutex);
-  if (t->stage != COMPLETED) {
+  if (__atomic_load_n(&t->stage, __ATOMIC_ACQUIRE) != COMPLETED) {
     printf("ERROR: Task not completed before being dismissed");
     exit(1);
   }
   t->stage = DISMISSED;
-  pthread_cond_destroy(&t->done);
-  free(t);
-  pthread_mutex_unlock(&mutex);
+  task_free(t);
+}
+
+void task_reset(Task * t) {
+  if (__atomic_load_n(&t->stage, __ATOMIC_ACQUIRE) != COMPLETED) {
+    printf("ERROR: Task not completed before being reset\n");
+    exit(1);
+  }
+  t->res = NULL;
+  t->deps = 0;
+  t->successors = NULL;
+  t->first.task = NULL;
+  t->group = NULL;
+  t->cancel = NULL;
+  t->skipped = 0;
+  t->blocking = 0;
+  __atomic_store_n(&t->stage, CREATED, __ATOMIC_RELEASE);
+}
+
+void task_set_spin(int max_spin) {
+  pthread_once(&policy_once, policy_init);
+  park_init(&await_policy, max_spin);
+}
+
+void task_wait_stats(long * spun, long * parked) {
+  pthread_once(&policy_once, policy_init);
+  *spun = __atomic_load_n(&await_policy.spun, __ATOMIC_RELAXED);
+  *parked = __atomic_load_n(&await_policy.parked, __ATOMIC_RELAXED);
+}
+
+void task_set_cancel(Task * t, CancelToken * c) {
+  t->cancel = c;
+}
+
+int task_cancelled(void) {
+  return current != NULL && current->cancel != NULL && cancel_requested(current->cancel);
+}
+
+Task * task_current(void) {
+  return current;
+}
+
+int task_skipped(Task * t) {
+  return t->skipped;
+}
+
+CancelToken * cancel_create(void) {
+  CancelToken * c = malloc(sizeof(CancelToken));
+  if (c == NULL) {
+    printf("ERROR: Cancellation token could not be allocated\n");
+    exit(1);
+  }
+  c->cancelled = 0;
+  return c;
+}
+
+void cancel_request(CancelToken * c) {
+  __atomic_store_n(&c->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+int cancel_requested(CancelToken * c) {
+  return __atomic_load_n(&c->cancelled, __ATOMIC_ACQUIRE);
+}
+
+void cancel_dismiss(CancelToken * c) {
+  free(c);
+}
+
+TaskGroup * group_create(void) {
+  TaskGroup * g = malloc(sizeof(TaskGroup));
+  if (g == NULL) {
+    printf("ERROR: Task group could not be allocated\n");
+    exit(1);
+  }
+  g->pending = 0;
+  g->completions = 0;
+  g->any_waiters = 0;
+  g->completed = NULL;
+  g->cancel = NULL;
+  return g;
+}
+
+void group_set_cancel(TaskGroup * g, CancelToken * c) {
+  g->cancel = c;
+}
+
+void group_add(TaskGroup * g, Task * t) {
+  if (t->cancel == NULL) t->cancel = g->cancel;
+  __atomic_fetch_add(&g->pending, 1, __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&t->group, g, __ATOMIC_ACQ_REL) == GROUP_DONE) {
+    /* Completed already, or just completing */
+    t->group = GROUP_DONE;
+    task_await(t);
+    group_task_done(g, t);
+  }
+}
+
+static int group_all_done(void * arg) {
+  TaskGroup * g = arg;
+  return __atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+void group_await_all(TaskGroup * g) {
+  int n;
+
+  pthread_once(&policy_once, policy_init);
+  if (group_all_done(g) || park_spin(&await_policy, group_all_done, g)) return;
+
+  if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0) park_slept(&await_policy);
+  while ((n = __atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) > 0) {
+    park_wait(&g->pending, n, NULL);
+  }
+}
+
+static int group_any_done(void * arg) {
+  TaskGroup * g = arg;
+  return __atomic_load_n(&g->completed, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Single consumer, so popping the stack is free from ABA */
+static Task * group_pop(TaskGroup * g) {
+  Task * t = __atomic_load_n(&g->completed, __ATOMIC_ACQUIRE);
+  while (t != NULL &&
+         !__atomic_compare_exchange_n(&g->completed, &t, t->group_next, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+  }
+  return t;
+}
+
+Task * group_await_any(TaskGroup * g) {
+  Task * t;
+
+  pthread_once(&policy_once, policy_init);
+  while ((t = group_pop(g)) == NULL) {
+    if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) == 0) {
+      /* A task may have completed since the pop */
+      if ((t = group_pop(g)) != NULL) break;
+      return NULL;
+    }
+    if (park_spin(&await_policy, group_any_done, g)) continue;
+
+    __atomic_fetch_add(&g->any_waiters, 1, __ATOMIC_SEQ_CST);
+    int seen = __atomic_load_n(&g->completions, __ATOMIC_SEQ_CST);
+    if (!group_any_done(g)) {
+      park_slept(&await_policy);
+      park_wait(&g->completions, seen, NULL);
+    }
+    __atomic_fetch_sub(&g->any_waiters, 1, __ATOMIC_RELAXED);
+  }
+  return t;
+}
+
+void group_dismiss(TaskGroup * g) {
+  /* Completed tasks may still be being counted down */
+  group_await_all(g);
+  free(g);
 }
@@ -11,12 +11,36 @@
 #include <pthread.h>
 #include <stddef.h>
 
-typedef struct {
+#define TASK_INLINE_SIZE 48  // Bytes of argument storage held by the task itself
+
+struct Task;
+
+typedef struct TaskGroup TaskGroup;  // Opaque type
+
+typedef struct CancelToken CancelToken;  // Opaque type
+
+typedef struct TaskLink {
+  struct Task * task;
+  struct TaskLink * next;
+} TaskLink;
+
+typedef struct Task {
   void * arg;                // Pointer to argument struct
   void * res;                // Pointer to result struct
   void * (*comp)(void *);    // Computation function
-  int stage;
-  pthread_cond_t done;       // Condition for awaing completion   
+  int stage;                 // Stage, futex word for awaiting completion
+  int deps;                  // Uncompleted tasks this task depends on
+  TaskLink * successors;     // Tasks depending on this one
+  TaskLink first;            // Inline link for the first successor
+  void * owner;              // Pool the task was submitted to, if any
+  TaskGroup * group;         // Group the task was added to, if any
+  CancelToken * cancel;      // Token cancelling the task, if any
+  int skipped;               // Completed without running, as cancelled
+  int blocking;              // Expected to block, see pool_submit_blocking
+  void * timer;              // Pending timer of its pool, if any
+  struct Task * next;        // Link in allocator free lists
+  struct Task * group_next;  // Link in the completed tasks of its group
+  char data[TASK_INLINE_SIZE] __attribute__((aligned(16)));  // Inline argument storage
 } Task;
 
 /**
@@ -26,6 +50,54 @@ typedef struct {
  */
 Task * task_create(void * a, void * (*f) (void *) );
 
+/**
+ * @name    task_create_inline
+ * @brief   Creates a task to be executed with a copy of the size bytes at a
+ *          (at most TASK_INLINE_SIZE) as argument, stored in the task itself.
+ *          The computation function gets a pointer to the copy and may also
+ *          leave results in it.  The copy is released with the task.
+ * @retval  Handle to the task
+ */
+Task * task_create_inline(const void * a, size_t size, void * (*f) (void *) );
+
+/**
+ * @name    task_create_after
+ * @brief   Creates a task that depends on the n tasks deps[0..n-1].  It is
+ *          made ready, and passed to the ready hook, once the last of them
+ *          has completed, so it must not be submitted by the caller.  It
+ *          goes to the pool of the dependency completing it, unless it has
+ *          an owner already.
+ * @retval  Handle to the task
+ */
+Task * task_create_after(Task ** deps, int n, void * a, void * (*f) (void *) );
+
+/**
+ * @name    task_then
+ * @brief   Creates a continuation of parent: a task computing f with parent
+ *          as argument once parent has completed (see task_create_after).
+ *          parent must not be dismissed before the continuation has run.
+ * @retval  Handle to the continuation
+ */
+Task * task_then(Task * parent, void * (*f) (void *) );
+
+/**
+ * @name    task_set_ready_hook
+ * @brief   Sets the function called with a task created by task_create_after
+ *          once its dependencies have completed, normally one submitting it
+ *          to its pool.  Without a hook such tasks are executed directly.
+ */
+void task_set_ready_hook(void (*hook) (Task *) );
+
+/**
+ * @name    task_set_help_hook
+ * @brief   Sets the function task_await calls repeatedly while the awaited
+ *          task is not completed, normally one running another queued task
+ *          when called from a pool worker.  It returns 1 if it ran a task,
+ *          0 if there was none to run, and -1 if the calling thread cannot
+ *          help, in which case task_await just waits.
+ */
+void task_set_help_hook(int (*hook) (void) );
+
 /**
  * @name    task_execute
  * @brief   Executes the computation function of a task and sets the result,
@@ -37,9 +109,18 @@ void task_execute(Task * t);
  * @name    task_await
  * @brief   Awaits the completion of a task.  After the call, the task is 
  *          known to be completed and the result is stable.
+ *          Pool workers run other tasks while they wait (see
+ *          task_set_help_hook), so tasks may await their subtasks.
  */
 void task_await(Task * t);
 
+/**
+ * @name    task_completed
+ * @brief   Tells whether task t has completed, without waiting
+ * @retval  1 if completed, otherwise 0
+ */
+int task_completed(Task * t);
+
 /**
  * @name    task_dismiss
  * @brief   Dismisses the resources used by a task.   Before call, the task
@@ -49,5 +130,137 @@ void task_await(Task * t);
  */
 void task_dismiss(Task * t);
 
+/**
+ * @name    task_reset
+ * @brief   Makes a completed task ready to be executed again with the same
+ *          computation function and argument, clearing its result and
+ *          forgetting its dependencies, successors, group and token.
+ *          No thread may be awaiting the task during the call.
+ */
+void task_reset(Task * t);
+
+/**
+ * @name    task_set_spin
+ * @brief   Sets the upper bound on the number of iterations task_await spins
+ *          before it sleeps.  The actual budget adapts to recent wait times
+ *          below this bound.  0 disables spinning, negative selects the default.
+ */
+void task_set_spin(int max_spin);
+
+/**
+ * @name    task_wait_stats
+ * @brief   Gives the number of task_await calls that had to wait and were
+ *          satisfied while spinning, and the number that had to sleep.
+ */
+void task_wait_stats(long * spun, long * parked);
+
+/**
+ * @name    task_set_cancel
+ * @brief   Attaches cancellation token c to task t before it is submitted.
+ *          If c is cancelled before t starts, t is completed without running
+ *          its computation; a running computation may poll task_cancelled.
+ */
+void task_set_cancel(Task * t, CancelToken * c);
+
+/**
+ * @name    task_cancelled
+ * @brief   Tells whether the token of the task being executed by the calling
+ *          thread has been cancelled, for computations to poll.
+ * @retval  1 if cancelled, otherwise 0
+ */
+int task_cancelled(void);
+
+/**
+ * @name    task_current
+ * @brief   Gives the task being executed by the calling thread
+ * @retval  The task, or NULL outside task computations
+ */
+Task * task_current(void);
+
+/**
+ * @name    task_skipped
+ * @brief   Tells whether completed task t was skipped, because it was
+ *          cancelled before it started.  Its result is then NULL.
+ * @retval  1 if skipped, otherwise 0
+ */
+int task_skipped(Task * t);
+
+/**
+ * @name    cancel_create
+ * @brief   Creates a cancellation token, not yet cancelled
+ * @retval  Handle to the token
+ */
+CancelToken * cancel_create(void);
+
+/**
+ * @name    cancel_request
+ * @brief   Cancels token c and so all tasks it is attached to.
+ *          Tasks already completed are not affected.
+ */
+void cancel_request(CancelToken * c);
+
+/**
+ * @name    cancel_requested
+ * @brief   Tells whether token c has been cancelled
+ * @retval  1 if cancelled, otherwise 0
+ */
+int cancel_requested(CancelToken * c);
+
+/**
+ * @name    cancel_dismiss
+ * @brief   Dismisses the resources used by a token.  No task it is attached
+ *          to may still be running or waiting to run.
+ */
+void cancel_dismiss(CancelToken * c);
+
+/**
+ * @name    group_create
+ * @brief   Creates an empty task group, a countdown of tasks that can be
+ *          awaited together
+ * @retval  Handle to the group
+ */
+TaskGroup * group_create(void);
+
+/**
+ * @name    group_add
+ * @brief   Adds task t to group g.  A task can be in one group at a time.
+ *          t may be added before or after it has been submitted, but must
+ *          not be dismissed until the group has released it (see below).
+ */
+void group_add(TaskGroup * g, Task * t);
+
+/**
+ * @name    group_set_cancel
+ * @brief   Attaches cancellation token c to group g: tasks added to g from
+ *          now on get c, unless they have a token already.
+ */
+void group_set_cancel(TaskGroup * g, CancelToken * c);
+
+/**
+ * @name    group_await_all
+ * @brief   Awaits the completion of every task added to g so far.  Only
+ *          the last completion wakes the caller.  Afterwards, all tasks of
+ *          the group are released.
+ */
+void group_await_all(TaskGroup * g);
+
+/**
+ * @name    group_await_any
+ * @brief   Awaits the completion of a task of g not yet returned by this
+ *          function.  Only one thread at a time may call it for a group.
+ *          The returned task is released by the group.
+ * @retval  A completed task, or NULL if every task added has been returned
+ */
+Task * group_await_any(TaskGroup * g);
+
+/**
+ * @name    group_dismiss
+ * @brief   Dismisses the resources used by a group.  Before call, all of its
+ *          tasks must be completed (or awaited with group_await_any); the
+ *          call waits for their completions to be recorded.  The tasks
+ *          themselves are not dismissed.
+ */
+void group_dismiss(TaskGroup * g);
+
 #endif /* TASK_H_INCLUDED */
 
@@ -0,0 +1,178 @@
+/**
+ * @file   topo.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  CPU topology implementation
+ */
+
+/* Implements */
+#include "topo.h"
+
+/* Uses */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYS_CPU  "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+/* Reads a line of a sysfs file, returns 0 if it could not be read */
+static int read_line(const char * path, char * buf, int size) {
+  FILE * f = fopen(path, "r");
+  int ok;
+
+  if (f == NULL) return 0;
+  ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+static int read_int(const char * path, int fallback) {
+  char buf[32];
+  return read_line(path, buf, sizeof(buf)) ? atoi(buf) : fallback;
+}
+
+int topo_parse_list(const char * list, int * cpus, int max) {
+  const char * s = list;
+  char * end;
+  int n = 0;
+
+  while (*s != '\0' && *s != '\n') {
+    long from = strtol(s, &end, 10);
+    long to = from;
+    if (end == s || from < 0) return -1;
+    s = end;
+    if (*s == '-') {
+      to = strtol(s + 1, &end, 10);
+      if (end == s + 1 || to < from) return -1;
+      s = end;
+    }
+    for (; from <= to && n < max; from++) {
+      cpus[n++] = from;
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s != '\0' && *s != '\n') {
+      return -1;
+    }
+  }
+  return n;
+}
+
+int topo_read(TopoCpu * cpus, int max) {
+  char path[128], buf[4096];
+  int ids[TOPO_MAX_CPUS];
+  int i, j, k, n;
+
+  if (max > TOPO_MAX_CPUS) max = TOPO_MAX_CPUS;
+
+  if (!read_line(SYS_CPU "/online", buf, sizeof(buf)) ||
+      (n = topo_parse_list(buf, ids, max)) <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > max) n = max;
+    for (i = 0; i < n; i++) {
+      ids[i] = i;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    cpus[i].cpu = ids[i];
+    snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/core_id", ids[i]);
+    cpus[i].core = read_int(path, ids[i]);
+    snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/physical_package_id", ids[i]);
+    cpus[i].package = read_int(path, 0);
+    cpus[i].node = 0;
+  }
+
+  /* Nodes list their CPUs */
+  for (k = 0; k < TOPO_MAX_NODES; k++) {
+    int node_cpus[TOPO_MAX_CPUS];
+    snprintf(path, sizeof(path), SYS_NODE "/node%d/cpulist", k);
+    if (!read_line(path, buf, sizeof(buf))) continue;
+    int m = topo_parse_list(buf, node_cpus, TOPO_MAX_CPUS);
+    for (j = 0; j < m; j++) {
+      for (i = 0; i < n; i++) {
+        if (cpus[i].cpu == node_cpus[j]) cpus[i].node = k;
+      }
+    }
+  }
+  return n;
+}
+
+int topo_nodes(TopoCpu * cpus, int n) {
+  int i, nodes = 1;
+
+  for (i = 0; i < n; i++) {
+    if (cpus[i].node + 1 > nodes) nodes = cpus[i].node + 1;
+  }
+  return nodes;
+}
+
+static int by_place(const void * a, const void * b) {
+  const TopoCpu * x = a;
+  const TopoCpu * y = b;
+
+  if (x->node != y->node) return x->node - y->node;
+  if (x->package != y->package) return x->package - y->package;
+  if (x->core != y->core) return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+
+void topo_compact(TopoCpu * cpus, int n) {
+  qsort(cpus, n, sizeof(TopoCpu), by_place);
+}
+
+/* Scatter keys: sibling index, core index within package, package index */
+typedef struct {
+  TopoCpu cpu;
+  int sibling, core, package;
+} Placed;
+
+static int by_scatter(const void * a, const void * b) {
+  const Placed * x = a;
+  const Placed * y = b;
+
+  if (x->sibling != y->sibling) return x->sibling - y->sibling;
+  if (x->core != y->core) return x->core - y->core;
+  if (x->package != y->package) return x->package - y->package;
+  return x->cpu.cpu - y->cpu.cpu;
+}
+
+void topo_scatter(TopoCpu * cpus, int n) {
+  Placed * p = malloc(sizeof(Placed) * (n > 0 ? n : 1));
+  int i, package = -1, core = -1, sibling = 0;
+
+  if (p == NULL) {
+    printf("ERROR: Topology could not be allocated\n");
+    exit(1);
+  }
+
+  /* Number packages, cores and siblings in compact order */
+  topo_compact(cpus, n);
+  for (i = 0; i < n; i++) {
+    int new_package = i == 0 || cpus[i].node != cpus[i-1].node ||
+                      cpus[i].package != cpus[i-1].package;
+    if (new_package) {
+      package++;
+      core = -1;
+    }
+    if (new_package || cpus[i].core != cpus[i-1].core) {
+      core++;
+      sibling = 0;
+    } else {
+      sibling++;
+    }
+    p[i].cpu = cpus[i];
+    p[i].sibling = sibling;
+    p[i].core = core;
+    p[i].package = package;
+  }
+
+  qsort(p, n, sizeof(Placed), by_scatter);
+  for (i = 0; i < n; i++) {
+    cpus[i] = p[i].cpu;
+  }
+  free(p);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file   topo.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  CPU topology interface
+ *
+ * Reads the topology of the online CPUs from sysfs and orders them for
+ * placing worker threads.
+ */
+
+#ifndef TOPO_H_INCLUDED
+#define TOPO_H_INCLUDED
+
+#define TOPO_MAX_CPUS  1024   // Max CPUs considered
+#define TOPO_MAX_NODES   64   // Max NUMA nodes considered
+
+typedef struct {
+  int cpu;                   // CPU number
+  int core;                  // Core id within the package
+  int package;               // Physical package (socket) id
+  int node;                  // NUMA node, 0 if unknown
+} TopoCpu;
+
+/**
+ * @name    topo_read
+ * @brief   Reads the topology of up to max online CPUs into cpus[], ordered
+ *          by CPU number.  Without sysfs, CPUs 0..n-1 are assumed to be
+ *          separate cores of one package.
+ * @retval  Number of CPUs read
+ */
+int topo_read(TopoCpu * cpus, int max);
+
+/**
+ * @name    topo_nodes
+ * @brief   Gives the number of NUMA nodes of the CPUs read by topo_read
+ */
+int topo_nodes(TopoCpu * cpus, int n);
+
+/**
+ * @name    topo_compact
+ * @brief   Orders cpus[] so consecutive CPUs are as close as possible:
+ *          hyperthreads of a core, then cores of a package, then packages.
+ */
+void topo_compact(TopoCpu * cpus, int n);
+
+/**
+ * @name    topo_scatter
+ * @brief   Orders cpus[] so consecutive CPUs are as far apart as possible:
+ *          one core per package in turn, hyperthread siblings last.
+ */
+void topo_scatter(TopoCpu * cpus, int n);
+
+/**
+ * @name    topo_parse_list
+ * @brief   Parses a CPU list such as "0-3,8,10-11" into up to max numbers
+ * @retval  Number of CPUs parsed, or -1 if the list is malformed
+ */
+int topo_parse_list(const char * list, int * cpus, int max);
+
+#endif /* TOPO_H_INCLUDED */
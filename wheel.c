@@ -0,0 +1,116 @@
+/**
+ * @file   wheel.c
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Hierarchical timing wheel implementation
+ *
+ * A node is placed in the lowest level whose range covers the ticks left
+ * until it expires, in the slot given by the corresponding bits of its
+ * expiry tick.  Whenever the slot index of a level wraps around, the next
+ * slot of the level above is emptied and its nodes are placed again.
+ */
+
+/* Implements */
+#include "wheel.h"
+
+/* Uses */
+#include <stddef.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+static void list_init(WheelNode * head) {
+  head->next = head;
+  head->prev = head;
+}
+
+void wheel_init(Wheel * w, unsigned long now) {
+  int l, s;
+
+  w->now = now;
+  w->count = 0;
+  for (l = 0; l < WHEEL_LEVELS; l++) {
+    for (s = 0; s < WHEEL_SLOTS; s++) {
+      list_init(&w->slots[l][s]);
+    }
+  }
+}
+
+static void place(Wheel * w, WheelNode * n) {
+  unsigned long delta = n->expires - w->now;
+  unsigned long at = n->expires;
+  int l;
+
+  for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+    if (delta < 1UL << (WHEEL_BITS * (l + 1))) break;
+  }
+  if (l == WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) {
+    /* Beyond the range: park it at the far end, it is placed again later */
+    at = w->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+
+  WheelNode * head = &w->slots[l][(at >> (WHEEL_BITS * l)) & SLOT_MASK];
+  n->prev = head->prev;
+  n->next = head;
+  head->prev->next = n;
+  head->prev = n;
+}
+
+void wheel_add(Wheel * w, WheelNode * n, unsigned long expires) {
+  if ((long) (expires - w->now) <= 0) expires = w->now + 1;
+  n->expires = expires;
+  place(w, n);
+  w->count++;
+}
+
+void wheel_remove(Wheel * w, WheelNode * n) {
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+  n->next = n->prev = NULL;
+  w->count--;
+}
+
+/* Places the nodes of a slot again, one level down or lower */
+static void cascade(Wheel * w, int l) {
+  WheelNode * head = &w->slots[l][(w->now >> (WHEEL_BITS * l)) & SLOT_MASK];
+  WheelNode * n = head->next;
+
+  list_init(head);
+  while (n != head) {
+    WheelNode * next = n->next;
+    place(w, n);
+    n = next;
+  }
+}
+
+void wheel_advance(Wheel * w, unsigned long now,
+                   void (*expire)(WheelNode * n, void * arg), void * arg) {
+  int l;
+
+  while ((long) (now - w->now) > 0) {
+    w->now++;
+
+    for (l = 1; l < WHEEL_LEVELS; l++) {
+      if ((w->now >> (WHEEL_BITS * (l - 1))) & SLOT_MASK) break;
+      cascade(w, l);
+    }
+
+    WheelNode * head = &w->slots[0][w->now & SLOT_MASK];
+    while (head->next != head) {
+      WheelNode * n = head->next;
+      wheel_remove(w, n);
+      expire(n, arg);
+    }
+  }
+}
+
+long wheel_next(Wheel * w) {
+  long i;
+
+  if (w->count == 0) return -1;
+  for (i = 1; i < WHEEL_SLOTS; i++) {
+    WheelNode * head = &w->slots[0][(w->now + i) & SLOT_MASK];
+    if (head->next != head) return i;
+  }
+  /* Only higher levels are in use, wake up at the next cascade */
+  return WHEEL_SLOTS - (w->now & SLOT_MASK);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file   wheel.h
+ * @Author 02335 team
+ * @date   November, 2024
+ * @brief  Hierarchical timing wheel interface
+ *
+ * Timers are nodes with an expiry time in ticks, kept in WHEEL_LEVELS
+ * wheels of WHEEL_SLOTS slots, each level covering WHEEL_SLOTS times the
+ * range of the one below.  Adding and removing a node take constant time;
+ * nodes are moved down a level as their expiry comes near.
+ * The wheel is not thread safe, callers must serialize all operations.
+ */
+
+#ifndef WHEEL_H_INCLUDED
+#define WHEEL_H_INCLUDED
+
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)   // Slots per level
+#define WHEEL_LEVELS  4                   // Range is WHEEL_SLOTS^WHEEL_LEVELS ticks
+
+typedef struct WheelNode {
+  struct WheelNode * next;
+  struct WheelNode * prev;
+  unsigned long expires;     // Tick at which the node expires
+} WheelNode;
+
+typedef struct {
+  unsigned long now;         // Last tick processed
+  long count;                // Nodes in the wheel
+  WheelNode slots[WHEEL_LEVELS][WHEEL_SLOTS];   // List heads
+} Wheel;
+
+/**
+ * @name    wheel_init
+ * @brief   Initializes an empty wheel whose current tick is now
+ */
+void wheel_init(Wheel * w, unsigned long now);
+
+/**
+ * @name    wheel_add
+ * @brief   Adds node n to expire at tick expires, at the earliest the next
+ *          tick after the current one
+ */
+void wheel_add(Wheel * w, WheelNode * n, unsigned long expires);
+
+/**
+ * @name    wheel_remove
+ * @brief   Removes node n, which must be in the wheel
+ */
+void wheel_remove(Wheel * w, WheelNode * n);
+
+/**
+ * @name    wheel_advance
+ * @brief   Processes the ticks up to and including tick now, calling expire
+ *          with each node expiring, after removing it.  expire may add
+ *          nodes again.
+ */
+void wheel_advance(Wheel * w, unsigned long now,
+                   void (*expire)(WheelNode * n, void * arg), void * arg);
+
+/**
+ * @name    wheel_next
+ * @brief   Gives the number of ticks after the current one before the wheel
+ *          next needs to be advanced.  This may be earlier than the next
+ *          expiry, when nodes only need to be moved down a level.
+ * @retval  Number of ticks, or -1 if the wheel is empty
+ */
+long wheel_next(Wheel * w);
+
+#endif /* WHEEL_H_INCLUDED */